@@ -14,7 +14,62 @@
  * credit be given to OICR scientists, as scientifically appropriate.
  */
 
+#include <algorithm>
+#include <cstdlib>
+#include <set>
 #include "bamql.hpp"
+#include "boolean_constant.hpp"
+#include "check_flag.hpp"
+#include "check_nt.hpp"
+#include "check_region.hpp"
+
+/**
+ * The most expensive operand that is evaluated unconditionally rather than
+ * branched around. A mispredicted branch costs more than a couple of checks of
+ * the flags, and close to half of them mispredict on data such as the strand
+ * or the read in a pair.
+ */
+#define EAGER_COST 2
+
+/**
+ * Determine if a node is cheap enough to evaluate whether or not its result
+ * is needed: it has no side effects and only does a few comparisons of the
+ * fixed fields of the read, each of the cheapest kind. Setting BAMQL_NO_EAGER
+ * always branches instead, so the two can be compared.
+ */
+static bool isTriviallyCheap(bamql::AstNode *node) {
+  static const bool eager = getenv("BAMQL_NO_EAGER") == nullptr;
+  if (!eager || node->hasSideEffects() || node->cost() > EAGER_COST) {
+    return false;
+  }
+  bool has_children = false;
+  bool cheap = true;
+  node->forEachChild([&](std::shared_ptr<bamql::AstNode> &child) {
+    has_children = true;
+    cheap &= isTriviallyCheap(child.get());
+  });
+  return has_children ? cheap : node->cost() <= 1;
+}
+
+/**
+ * Create a constant node.
+ */
+static std::shared_ptr<bamql::AstNode> makeConstant(bool value) {
+  if (value) {
+    return std::make_shared<
+        bamql::ConstantNode<llvm::ConstantInt::getTrue>>();
+  } else {
+    return std::make_shared<
+        bamql::ConstantNode<llvm::ConstantInt::getFalse>>();
+  }
+}
+
+void bamql::simplify(std::shared_ptr<AstNode> &node) {
+  auto replacement = node->simplified();
+  if (replacement) {
+    node = replacement;
+  }
+}
 
 bamql::ShortCircuitNode::ShortCircuitNode(std::shared_ptr<AstNode> left,
                                           std::shared_ptr<AstNode> right) {
@@ -26,6 +81,21 @@ llvm::Value *bamql::ShortCircuitNode::generateGeneric(GenerateMember member,
                                                       GenerateState &state,
                                                       llvm::Value *param,
                                                       llvm::Value *header) {
+  if (isTriviallyCheap(right.get())) {
+    /* Evaluate both sides and combine them without branching. */
+    this->left->writeDebug(state);
+    auto left_value = ((*this->left).*member)(state, param, header);
+    this->right->writeDebug(state);
+    auto right_value = ((*this->right).*member)(state, param, header);
+    if (state.profile() != nullptr && member == &bamql::AstNode::generate) {
+      state.profile()->record(state, this->left.get(), left_value);
+      state.profile()->record(state, this->right.get(), right_value);
+    }
+    return llvm::cast<llvm::ConstantInt>(branchValue())->isOne()
+               ? state->CreateOr(left_value, right_value)
+               : state->CreateAnd(left_value, right_value);
+  }
+
   /* Create two basic blocks for the possibly executed right-hand expression and
    * the final block. */
   auto function = state->GetInsertBlock()->getParent();
@@ -37,6 +107,9 @@ llvm::Value *bamql::ShortCircuitNode::generateGeneric(GenerateMember member,
   /* Generate the left expression in the current block. */
   this->left->writeDebug(state);
   auto left_value = ((*this->left).*member)(state, param, header);
+  if (state.profile() != nullptr && member == &bamql::AstNode::generate) {
+    state.profile()->record(state, this->left.get(), left_value);
+  }
   auto short_circuit_value =
       state->CreateICmpEQ(left_value, this->branchValue());
   /* If short circuiting, jump to the final block, otherwise, do the right-hand
@@ -48,6 +121,9 @@ llvm::Value *bamql::ShortCircuitNode::generateGeneric(GenerateMember member,
   state->SetInsertPoint(next_block);
   this->right->writeDebug(state);
   auto right_value = ((*this->right).*member)(state, param, header);
+  if (state.profile() != nullptr && member == &bamql::AstNode::generate) {
+    state.profile()->record(state, this->right.get(), right_value);
+  }
   state->CreateBr(merge_block);
   next_block = state->GetInsertBlock();
 
@@ -79,6 +155,269 @@ llvm::Value *bamql::ShortCircuitNode::generateIndex(GenerateState &state,
 bool bamql::ShortCircuitNode::usesIndex() {
   return left->usesIndex() || right->usesIndex();
 }
+bool bamql::ShortCircuitNode::indexIsExact() {
+  return usesIndex() && left->indexIsExact() && right->indexIsExact();
+}
+bool bamql::ShortCircuitNode::isInterpretable() {
+  return left->isInterpretable() && right->isInterpretable();
+}
+unsigned int bamql::ShortCircuitNode::cost() {
+  return left->cost() + right->cost();
+}
+bool bamql::ShortCircuitNode::hasSideEffects() {
+  return left->hasSideEffects() || right->hasSideEffects();
+}
+void bamql::ShortCircuitNode::forEachOperand(
+    const std::function<void(std::shared_ptr<AstNode> &)> &function) {
+  for (auto operand : { &left, &right }) {
+    auto chain = std::dynamic_pointer_cast<ShortCircuitNode>(*operand);
+    if (chain && chain->branchValue() == branchValue()) {
+      chain->forEachOperand(function);
+    } else {
+      function(*operand);
+    }
+  }
+}
+void bamql::ShortCircuitNode::optimise(const Profile *profile) {
+  std::vector<std::shared_ptr<AstNode>> operands;
+  forEachOperand([&](std::shared_ptr<AstNode> &operand) {
+    operand->optimise(profile);
+    operands.push_back(operand);
+  });
+
+  /* The best order puts first the operands with the lowest cost per chance
+   * of short circuiting. Without a profile, every operand is assumed to be
+   * equally likely to short circuit, so only the cost matters. */
+  bool short_circuits_on_true =
+      llvm::cast<llvm::ConstantInt>(branchValue())->isOne();
+  std::map<AstNode *, double> rank;
+  for (auto it = operands.begin(); it != operands.end(); it++) {
+    double chance = 0.5;
+    double selectivity =
+        profile == nullptr ? -1 : profile->selectivity(it->get());
+    if (selectivity >= 0) {
+      chance = short_circuits_on_true ? selectivity : 1 - selectivity;
+    }
+    rank[it->get()] = (*it)->cost() / std::max(chance, 0.001);
+  }
+
+  /* Never move an operand past one with side effects, since short circuiting
+   * changes whether it is evaluated. */
+  auto by_cost = [&](const std::shared_ptr<AstNode> &a,
+                     const std::shared_ptr<AstNode> &b) {
+    return rank[a.get()] < rank[b.get()];
+  };
+  auto run_start = operands.begin();
+  for (auto it = operands.begin(); it != operands.end(); it++) {
+    if ((*it)->hasSideEffects()) {
+      std::stable_sort(run_start, it, by_cost);
+      run_start = it + 1;
+    }
+  }
+  std::stable_sort(run_start, operands.end(), by_cost);
+
+  /* The operation is associative, so the operands can be put back into the
+   * same tree in the new order. */
+  auto next = operands.begin();
+  forEachOperand(
+      [&](std::shared_ptr<AstNode> &operand) { operand = *next++; });
+}
+std::string bamql::ShortCircuitNode::key() {
+  auto left_key = left->key();
+  auto right_key = right->key();
+  if (left_key.empty() || right_key.empty()) {
+    return std::string();
+  }
+  auto op = llvm::cast<llvm::ConstantInt>(branchValue())->isOne() ? "|" : "&";
+  return "(" + left_key + op + right_key + ")";
+}
+void bamql::ShortCircuitNode::forEachChild(
+    const std::function<void(std::shared_ptr<AstNode> &)> &function) {
+  function(left);
+  function(right);
+}
+/**
+ * Determine if a node checks for reads overlapping regions of particular
+ * chromosomes. Plain checks of chromosomes are cheaper as they are, so at
+ * least part of some chromosome must be excluded.
+ */
+static bool isPositionalRegion(std::shared_ptr<bamql::AstNode> &node,
+                               bamql::RegionMap &regions) {
+  if (!node->regionTest(regions) || regions.count(std::string()) > 0) {
+    return false;
+  }
+  for (auto it = regions.begin(); it != regions.end(); it++) {
+    for (auto range = it->second.begin(); range != it->second.end();
+         range++) {
+      if (range->first > 1 || range->second < INT32_MAX) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+std::shared_ptr<bamql::AstNode> bamql::ShortCircuitNode::simplified() {
+  bool is_or = llvm::cast<llvm::ConstantInt>(branchValue())->isOne();
+
+  /* Simplify the operands of the whole chain (e.g., `a & (b & c)`), which may
+   * produce more operands if one simplifies into the same operation. */
+  std::vector<std::shared_ptr<AstNode>> operands;
+  std::function<void(std::shared_ptr<AstNode>, bool)> collect =
+      [&](std::shared_ptr<AstNode> node, bool simplified) {
+        auto chain = std::dynamic_pointer_cast<ShortCircuitNode>(node);
+        if (chain && chain->branchValue() == branchValue()) {
+          collect(chain->left, false);
+          collect(chain->right, false);
+        } else if (simplified) {
+          operands.push_back(node);
+        } else {
+          simplify(node);
+          collect(node, true);
+        }
+      };
+  collect(left, false);
+  collect(right, false);
+
+  /* Drop the constants that don't matter and combine the flag checks. An OR
+   * of flag checks is the complement of an AND of their complements, so it
+   * can be combined too. An OR of nucleotide checks is combined into one
+   * check, so the CIGAR string is only walked once, and an OR of checks of
+   * positions on particular chromosomes into one table of regions. Nothing
+   * moves past an operand with side effects. */
+  std::vector<std::shared_ptr<AstNode>> result;
+  size_t barrier = 0;
+  size_t flags_index = 0;
+  bool has_flags = false;
+  uint16_t flags_mask = 0;
+  uint16_t flags_value = 0;
+  size_t nt_index[2] = { 0, 0 };
+  bool has_nt[2] = { false, false };
+  std::vector<std::pair<int32_t, unsigned char>> nt_sites[2];
+  size_t region_index = 0;
+  bool has_regions = false;
+  RegionMap region_map;
+  for (auto it = operands.begin(); it != operands.end(); it++) {
+    bool value;
+    if ((*it)->constantValue(value)) {
+      if (value == is_or) {
+        // This always short circuits, so nothing after it is evaluated and
+        // nothing before it, back to the last side effect, matters.
+        result.resize(barrier);
+        result.push_back(*it);
+        break;
+      }
+      continue;
+    }
+    if ((*it)->hasSideEffects()) {
+      has_flags = false;
+      has_nt[false] = false;
+      has_nt[true] = false;
+      has_regions = false;
+      result.push_back(*it);
+      barrier = result.size();
+      continue;
+    }
+    std::vector<std::pair<int32_t, unsigned char>> sites;
+    bool exact;
+    if (is_or && (*it)->nucleotideTest(sites, exact)) {
+      if (!has_nt[exact]) {
+        has_nt[exact] = true;
+        nt_index[exact] = result.size();
+        nt_sites[exact] = sites;
+        result.push_back(*it);
+      } else {
+        nt_sites[exact].insert(
+            nt_sites[exact].end(), sites.begin(), sites.end());
+        result[nt_index[exact]] =
+            std::make_shared<NucleotideSetNode>(nt_sites[exact], exact);
+      }
+      continue;
+    }
+    RegionMap regions;
+    if (is_or && isPositionalRegion(*it, regions)) {
+      if (!has_regions) {
+        has_regions = true;
+        region_index = result.size();
+        region_map = regions;
+        result.push_back(*it);
+      } else {
+        for (auto region = regions.begin(); region != regions.end();
+             region++) {
+          auto &ranges = region_map[region->first];
+          ranges.insert(
+              ranges.end(), region->second.begin(), region->second.end());
+          normaliseRanges(ranges);
+        }
+        result[region_index] =
+            std::make_shared<RegionNode>(region_map, std::string());
+      }
+      continue;
+    }
+    uint16_t mask;
+    uint16_t bits;
+    bool negated;
+    if (!(*it)->flagTest(mask, bits, negated)) {
+      result.push_back(*it);
+      continue;
+    }
+    // Convert the check into the form `(flag & mask) == bits`, if possible.
+    if (negated != is_or) {
+      if ((mask & (mask - 1)) != 0) {
+        result.push_back(*it);
+        continue;
+      }
+      bits ^= mask;
+    }
+    if (!has_flags) {
+      has_flags = true;
+      flags_index = result.size();
+      flags_mask = mask;
+      flags_value = bits;
+      result.push_back(*it);
+      continue;
+    }
+    if ((bits & flags_mask) != (flags_value & mask)) {
+      // The checks contradict each other, so the combination always short
+      // circuits.
+      result.resize(barrier);
+      result.push_back(makeConstant(is_or));
+      break;
+    }
+    flags_mask |= mask;
+    flags_value |= bits;
+    result[flags_index] =
+        std::make_shared<FlagMaskNode>(flags_mask, flags_value, is_or);
+  }
+
+  if (result.empty()) {
+    return makeConstant(!is_or);
+  }
+  auto node = result.back();
+  for (auto it = result.rbegin() + 1; it != result.rend(); it++) {
+    if (is_or) {
+      node = std::make_shared<OrNode>(*it, node);
+    } else {
+      node = std::make_shared<AndNode>(*it, node);
+    }
+  }
+  return node;
+}
+std::shared_ptr<bamql::AstNode> bamql::ShortCircuitNode::negate() {
+  /* De Morgan's laws, if both sides can be complemented without a NOT. */
+  auto left_negated = left->negate();
+  auto right_negated = right->negate();
+  if (!left_negated || !right_negated) {
+    return nullptr;
+  }
+  std::shared_ptr<AstNode> result;
+  if (llvm::cast<llvm::ConstantInt>(branchValue())->isOne()) {
+    result = std::make_shared<AndNode>(left_negated, right_negated);
+  } else {
+    result = std::make_shared<OrNode>(left_negated, right_negated);
+  }
+  simplify(result);
+  return result;
+}
 void bamql::ShortCircuitNode::writeDebug(GenerateState &state) {}
 
 bamql::AndNode::AndNode(std::shared_ptr<AstNode> left,
@@ -87,6 +426,94 @@ bamql::AndNode::AndNode(std::shared_ptr<AstNode> left,
 llvm::Value *bamql::AndNode::branchValue() {
   return llvm::ConstantInt::getFalse(llvm::getGlobalContext());
 }
+bool bamql::AndNode::evaluate(bam_hdr_t *header,
+                              bam1_t *read,
+                              bamql_read_context *context) {
+  return left->evaluate(header, read, context) &&
+         right->evaluate(header, read, context);
+}
+bool bamql::AndNode::evaluateIndex(bam_hdr_t *header, uint32_t tid) {
+  return !usesIndex() || left->evaluateIndex(header, tid) &&
+                             right->evaluateIndex(header, tid);
+}
+/**
+ * Get the ranges a region map has for a chromosome, including those for every
+ * chromosome.
+ */
+static bamql::PositionRanges rangesFor(bamql::RegionMap &regions,
+                                       const std::string &name) {
+  bamql::PositionRanges result;
+  for (auto key : { name, std::string() }) {
+    auto found = regions.find(key);
+    if (found != regions.end()) {
+      result.insert(result.end(), found->second.begin(), found->second.end());
+    }
+    if (name.empty()) {
+      break;
+    }
+  }
+  bamql::normaliseRanges(result);
+  return result;
+}
+bool bamql::AndNode::regionTest(RegionMap &regions) {
+  RegionMap left_regions;
+  RegionMap right_regions;
+  if (!left->regionTest(left_regions) || !right->regionTest(right_regions)) {
+    return false;
+  }
+  std::set<std::string> names;
+  for (auto map : { &left_regions, &right_regions }) {
+    for (auto it = map->begin(); it != map->end(); it++) {
+      names.insert(it->first);
+    }
+  }
+  regions.clear();
+  for (auto name = names.begin(); name != names.end(); name++) {
+    auto ranges = intersectRanges(rangesFor(left_regions, *name),
+                                  rangesFor(right_regions, *name));
+    if (!ranges.empty()) {
+      regions[*name] = ranges;
+    }
+  }
+  return true;
+}
+bool bamql::AndNode::positionRanges(bam_hdr_t *header,
+                                    uint32_t tid,
+                                    PositionRanges &ranges) {
+  /* A read must satisfy both sides, so either restriction alone is
+   * sufficient. */
+  PositionRanges right_ranges;
+  if (!left->positionRanges(header, tid, ranges)) {
+    return right->positionRanges(header, tid, ranges);
+  }
+  if (right->positionRanges(header, tid, right_ranges)) {
+    ranges = intersectRanges(ranges, right_ranges);
+  }
+  return true;
+}
+bool bamql::AndNode::isVectorisable() {
+  return left->isVectorisable() && right->isVectorisable();
+}
+bool bamql::AndNode::hasVectorGuard() {
+  return left->hasVectorGuard() || right->hasVectorGuard();
+}
+llvm::Value *bamql::AndNode::generateVector(GenerateState &state,
+                                            VectorColumns &columns) {
+  return state->CreateAnd(left->generateVector(state, columns),
+                          right->generateVector(state, columns));
+}
+llvm::Value *bamql::AndNode::generateVectorGuard(GenerateState &state,
+                                                 VectorColumns &columns) {
+  /* A read must satisfy both sides, so either guard alone is sufficient. */
+  if (!left->hasVectorGuard()) {
+    return right->generateVectorGuard(state, columns);
+  }
+  if (!right->hasVectorGuard()) {
+    return left->generateVectorGuard(state, columns);
+  }
+  return state->CreateAnd(left->generateVectorGuard(state, columns),
+                          right->generateVectorGuard(state, columns));
+}
 
 bamql::OrNode::OrNode(std::shared_ptr<AstNode> left,
                       std::shared_ptr<AstNode> right)
@@ -94,6 +521,56 @@ bamql::OrNode::OrNode(std::shared_ptr<AstNode> left,
 llvm::Value *bamql::OrNode::branchValue() {
   return llvm::ConstantInt::getTrue(llvm::getGlobalContext());
 }
+bool bamql::OrNode::evaluate(bam_hdr_t *header,
+                             bam1_t *read,
+                             bamql_read_context *context) {
+  return left->evaluate(header, read, context) ||
+         right->evaluate(header, read, context);
+}
+bool bamql::OrNode::evaluateIndex(bam_hdr_t *header, uint32_t tid) {
+  return !usesIndex() || left->evaluateIndex(header, tid) ||
+         right->evaluateIndex(header, tid);
+}
+bool bamql::OrNode::regionTest(RegionMap &regions) {
+  RegionMap right_regions;
+  if (!left->regionTest(regions) || !right->regionTest(right_regions)) {
+    return false;
+  }
+  for (auto it = right_regions.begin(); it != right_regions.end(); it++) {
+    auto &ranges = regions[it->first];
+    ranges.insert(ranges.end(), it->second.begin(), it->second.end());
+    normaliseRanges(ranges);
+  }
+  return true;
+}
+bool bamql::OrNode::positionRanges(bam_hdr_t *header,
+                                   uint32_t tid,
+                                   PositionRanges &ranges) {
+  PositionRanges right_ranges;
+  if (!left->positionRanges(header, tid, ranges) ||
+      !right->positionRanges(header, tid, right_ranges)) {
+    return false;
+  }
+  ranges.insert(ranges.end(), right_ranges.begin(), right_ranges.end());
+  normaliseRanges(ranges);
+  return true;
+}
+bool bamql::OrNode::isVectorisable() {
+  return left->isVectorisable() && right->isVectorisable();
+}
+bool bamql::OrNode::hasVectorGuard() {
+  return left->hasVectorGuard() && right->hasVectorGuard();
+}
+llvm::Value *bamql::OrNode::generateVector(GenerateState &state,
+                                           VectorColumns &columns) {
+  return state->CreateOr(left->generateVector(state, columns),
+                         right->generateVector(state, columns));
+}
+llvm::Value *bamql::OrNode::generateVectorGuard(GenerateState &state,
+                                                VectorColumns &columns) {
+  return state->CreateOr(left->generateVectorGuard(state, columns),
+                         right->generateVectorGuard(state, columns));
+}
 
 bamql::XOrNode::XOrNode(std::shared_ptr<AstNode> left_,
                         std::shared_ptr<AstNode> right_)
@@ -119,6 +596,83 @@ llvm::Value *bamql::XOrNode::generateIndex(GenerateState &state,
 bool bamql::XOrNode::usesIndex() {
   return left->usesIndex() || right->usesIndex();
 }
+bool bamql::XOrNode::indexIsExact() {
+  return usesIndex() && left->indexIsExact() && right->indexIsExact();
+}
+bool bamql::XOrNode::isInterpretable() {
+  return left->isInterpretable() && right->isInterpretable();
+}
+bool bamql::XOrNode::evaluate(bam_hdr_t *header,
+                              bam1_t *read,
+                              bamql_read_context *context) {
+  auto left_value = left->evaluate(header, read, context);
+  auto right_value = right->evaluate(header, read, context);
+  return left_value != right_value;
+}
+bool bamql::XOrNode::evaluateIndex(bam_hdr_t *header, uint32_t tid) {
+  return !usesIndex() ||
+         left->evaluateIndex(header, tid) != right->evaluateIndex(header, tid);
+}
+bool bamql::XOrNode::isVectorisable() {
+  return left->isVectorisable() && right->isVectorisable();
+}
+llvm::Value *bamql::XOrNode::generateVector(GenerateState &state,
+                                            VectorColumns &columns) {
+  return state->CreateXor(left->generateVector(state, columns),
+                          right->generateVector(state, columns));
+}
+
+unsigned int bamql::XOrNode::cost() { return left->cost() + right->cost(); }
+bool bamql::XOrNode::hasSideEffects() {
+  return left->hasSideEffects() || right->hasSideEffects();
+}
+void bamql::XOrNode::optimise(const Profile *profile) {
+  left->optimise(profile);
+  right->optimise(profile);
+}
+std::string bamql::XOrNode::key() {
+  auto left_key = left->key();
+  auto right_key = right->key();
+  if (left_key.empty() || right_key.empty()) {
+    return std::string();
+  }
+  return "(" + left_key + "^" + right_key + ")";
+}
+void bamql::XOrNode::forEachChild(
+    const std::function<void(std::shared_ptr<AstNode> &)> &function) {
+  function(left);
+  function(right);
+}
+std::shared_ptr<bamql::AstNode> bamql::XOrNode::simplified() {
+  simplify(left);
+  simplify(right);
+  /* Both sides are always evaluated, so a constant side can be removed. */
+  bool value;
+  std::shared_ptr<AstNode> other;
+  if (left->constantValue(value)) {
+    other = right;
+  } else if (right->constantValue(value)) {
+    other = left;
+  } else {
+    return nullptr;
+  }
+  if (!value) {
+    return other;
+  }
+  auto negated = other->negate();
+  return negated ? negated : std::make_shared<NotNode>(other);
+}
+std::shared_ptr<bamql::AstNode> bamql::XOrNode::negate() {
+  auto left_negated = left->negate();
+  if (left_negated) {
+    return std::make_shared<XOrNode>(left_negated, right);
+  }
+  auto right_negated = right->negate();
+  if (right_negated) {
+    return std::make_shared<XOrNode>(left, right_negated);
+  }
+  return nullptr;
+}
 
 void bamql::XOrNode::writeDebug(GenerateState &state) {}
 
@@ -139,6 +693,39 @@ llvm::Value *bamql::NotNode::generateIndex(GenerateState &state,
   return state->CreateNot(result);
 }
 bool bamql::NotNode::usesIndex() { return expr->usesIndex(); }
+bool bamql::NotNode::indexIsExact() { return expr->indexIsExact(); }
+bool bamql::NotNode::isInterpretable() { return expr->isInterpretable(); }
+bool bamql::NotNode::evaluate(bam_hdr_t *header,
+                              bam1_t *read,
+                              bamql_read_context *context) {
+  return !expr->evaluate(header, read, context);
+}
+bool bamql::NotNode::evaluateIndex(bam_hdr_t *header, uint32_t tid) {
+  return !expr->evaluateIndex(header, tid);
+}
+bool bamql::NotNode::isVectorisable() { return expr->isVectorisable(); }
+llvm::Value *bamql::NotNode::generateVector(GenerateState &state,
+                                            VectorColumns &columns) {
+  return state->CreateNot(expr->generateVector(state, columns));
+}
+unsigned int bamql::NotNode::cost() { return expr->cost(); }
+bool bamql::NotNode::hasSideEffects() { return expr->hasSideEffects(); }
+void bamql::NotNode::optimise(const Profile *profile) {
+  expr->optimise(profile);
+}
+std::string bamql::NotNode::key() {
+  auto expr_key = expr->key();
+  return expr_key.empty() ? expr_key : "!" + expr_key;
+}
+void bamql::NotNode::forEachChild(
+    const std::function<void(std::shared_ptr<AstNode> &)> &function) {
+  function(expr);
+}
+std::shared_ptr<bamql::AstNode> bamql::NotNode::simplified() {
+  simplify(expr);
+  return expr->negate();
+}
+std::shared_ptr<bamql::AstNode> bamql::NotNode::negate() { return expr; }
 void bamql::NotNode::writeDebug(GenerateState &state) {}
 
 bamql::ConditionalNode::ConditionalNode(std::shared_ptr<AstNode> condition,
@@ -152,6 +739,17 @@ bamql::ConditionalNode::ConditionalNode(std::shared_ptr<AstNode> condition,
 llvm::Value *bamql::ConditionalNode::generate(GenerateState &state,
                                               llvm::Value *read,
                                               llvm::Value *header) {
+  if (isTriviallyCheap(then_part.get()) && isTriviallyCheap(else_part.get())) {
+    /* Evaluate both branches and select the result without branching. */
+    this->condition->writeDebug(state);
+    auto conditional_result = condition->generate(state, read, header);
+    this->then_part->writeDebug(state);
+    auto then_result = then_part->generate(state, read, header);
+    this->else_part->writeDebug(state);
+    auto else_result = else_part->generate(state, read, header);
+    return state->CreateSelect(conditional_result, then_result, else_result);
+  }
+
   /* Create three blocks: one for the “then”, one for the “else” and one for the
    * final. */
   auto function = state->GetInsertBlock()->getParent();
@@ -278,4 +876,240 @@ llvm::Value *bamql::ConditionalNode::generateIndex(GenerateState &state,
   }
   return llvm::ConstantInt::getTrue(llvm::getGlobalContext());
 }
+bool bamql::ConditionalNode::isInterpretable() {
+  return condition->isInterpretable() && then_part->isInterpretable() &&
+         else_part->isInterpretable();
+}
+bool bamql::ConditionalNode::evaluate(bam_hdr_t *header,
+                                      bam1_t *read,
+                                      bamql_read_context *context) {
+  return condition->evaluate(header, read, context)
+             ? then_part->evaluate(header, read, context)
+             : else_part->evaluate(header, read, context);
+}
+bool bamql::ConditionalNode::evaluateIndex(bam_hdr_t *header, uint32_t tid) {
+  /* This follows `generateIndex`, which explains the cases. */
+  if (condition->usesIndex()) {
+    return condition->evaluateIndex(header, tid) &&
+               then_part->evaluateIndex(header, tid) ||
+           else_part->evaluateIndex(header, tid);
+  }
+  if (then_part->usesIndex() && else_part->usesIndex()) {
+    return then_part->evaluateIndex(header, tid) ||
+           else_part->evaluateIndex(header, tid);
+  }
+  return true;
+}
+bool bamql::ConditionalNode::positionRanges(bam_hdr_t *header,
+                                            uint32_t tid,
+                                            PositionRanges &ranges) {
+  /* Either branch may be taken, so both must be restricted. */
+  PositionRanges else_ranges;
+  if (!then_part->positionRanges(header, tid, ranges) ||
+      !else_part->positionRanges(header, tid, else_ranges)) {
+    return false;
+  }
+  ranges.insert(ranges.end(), else_ranges.begin(), else_ranges.end());
+  normaliseRanges(ranges);
+  return true;
+}
+bool bamql::ConditionalNode::isVectorisable() {
+  return condition->isVectorisable() && then_part->isVectorisable() &&
+         else_part->isVectorisable();
+}
+llvm::Value *bamql::ConditionalNode::generateVector(GenerateState &state,
+                                                    VectorColumns &columns) {
+  return state->CreateSelect(condition->generateVector(state, columns),
+                             then_part->generateVector(state, columns),
+                             else_part->generateVector(state, columns));
+}
+unsigned int bamql::ConditionalNode::cost() {
+  return condition->cost() + std::max(then_part->cost(), else_part->cost());
+}
+bool bamql::ConditionalNode::hasSideEffects() {
+  return condition->hasSideEffects() || then_part->hasSideEffects() ||
+         else_part->hasSideEffects();
+}
+void bamql::ConditionalNode::optimise(const Profile *profile) {
+  condition->optimise(profile);
+  then_part->optimise(profile);
+  else_part->optimise(profile);
+}
+std::string bamql::ConditionalNode::key() {
+  auto condition_key = condition->key();
+  auto then_key = then_part->key();
+  auto else_key = else_part->key();
+  if (condition_key.empty() || then_key.empty() || else_key.empty()) {
+    return std::string();
+  }
+  return "(" + condition_key + "?" + then_key + ":" + else_key + ")";
+}
+void bamql::ConditionalNode::forEachChild(
+    const std::function<void(std::shared_ptr<AstNode> &)> &function) {
+  function(condition);
+  function(then_part);
+  function(else_part);
+}
+std::shared_ptr<bamql::AstNode> bamql::ConditionalNode::simplified() {
+  simplify(condition);
+  simplify(then_part);
+  simplify(else_part);
+  bool value;
+  if (condition->constantValue(value)) {
+    return value ? then_part : else_part;
+  }
+  return nullptr;
+}
+std::shared_ptr<bamql::AstNode> bamql::ConditionalNode::negate() {
+  auto then_negated = then_part->negate();
+  auto else_negated = else_part->negate();
+  if (!then_negated || !else_negated) {
+    return nullptr;
+  }
+  return std::make_shared<ConditionalNode>(
+      condition, then_negated, else_negated);
+}
+
 void bamql::ConditionalNode::writeDebug(GenerateState &) {}
+
+bamql::SharedNode::SharedNode(std::shared_ptr<AstNode> expr_) : expr(expr_) {}
+llvm::Value *bamql::SharedNode::generate(GenerateState &state,
+                                         llvm::Value *read,
+                                         llvm::Value *header) {
+  auto slot = state.memoSlot(this);
+  if (slot == nullptr) {
+    return expr->generate(state, read, header);
+  }
+  /* Check if the result is already known for this read; if not, compute it
+   * and remember it. */
+  auto function = state->GetInsertBlock()->getParent();
+  auto compute_block =
+      llvm::BasicBlock::Create(llvm::getGlobalContext(), "compute", function);
+  auto merge_block =
+      llvm::BasicBlock::Create(llvm::getGlobalContext(), "merge", function);
+  auto byte_type = llvm::Type::getInt8Ty(llvm::getGlobalContext());
+  auto known = state->CreateLoad(slot);
+  auto known_value =
+      state->CreateICmpEQ(known, llvm::ConstantInt::get(byte_type, 2));
+  state->CreateCondBr(
+      state->CreateICmpNE(known, llvm::ConstantInt::get(byte_type, 0)),
+      merge_block,
+      compute_block);
+  auto original_block = state->GetInsertBlock();
+
+  state->SetInsertPoint(compute_block);
+  expr->writeDebug(state);
+  auto computed_value = expr->generate(state, read, header);
+  state->CreateStore(
+      state->CreateSelect(computed_value,
+                          llvm::ConstantInt::get(byte_type, 2),
+                          llvm::ConstantInt::get(byte_type, 1)),
+      slot);
+  state->CreateBr(merge_block);
+  compute_block = state->GetInsertBlock();
+
+  state->SetInsertPoint(merge_block);
+  auto phi =
+      state->CreatePHI(llvm::Type::getInt1Ty(llvm::getGlobalContext()), 2);
+  phi->addIncoming(known_value, original_block);
+  phi->addIncoming(computed_value, compute_block);
+  return phi;
+}
+llvm::Value *bamql::SharedNode::generateIndex(GenerateState &state,
+                                              llvm::Value *tid,
+                                              llvm::Value *header) {
+  return expr->generateIndex(state, tid, header);
+}
+bool bamql::SharedNode::usesIndex() { return expr->usesIndex(); }
+bool bamql::SharedNode::indexIsExact() { return expr->indexIsExact(); }
+bool bamql::SharedNode::isInterpretable() { return expr->isInterpretable(); }
+bool bamql::SharedNode::evaluate(bam_hdr_t *header,
+                                 bam1_t *read,
+                                 bamql_read_context *context) {
+  return expr->evaluate(header, read, context);
+}
+bool bamql::SharedNode::evaluateIndex(bam_hdr_t *header, uint32_t tid) {
+  return expr->evaluateIndex(header, tid);
+}
+bool bamql::SharedNode::positionRanges(bam_hdr_t *header,
+                                       uint32_t tid,
+                                       PositionRanges &ranges) {
+  return expr->positionRanges(header, tid, ranges);
+}
+bool bamql::SharedNode::isVectorisable() { return expr->isVectorisable(); }
+bool bamql::SharedNode::hasVectorGuard() { return expr->hasVectorGuard(); }
+llvm::Value *bamql::SharedNode::generateVector(GenerateState &state,
+                                               VectorColumns &columns) {
+  return expr->generateVector(state, columns);
+}
+llvm::Value *bamql::SharedNode::generateVectorGuard(GenerateState &state,
+                                                    VectorColumns &columns) {
+  return expr->generateVectorGuard(state, columns);
+}
+unsigned int bamql::SharedNode::cost() { return expr->cost(); }
+bool bamql::SharedNode::hasSideEffects() { return expr->hasSideEffects(); }
+void bamql::SharedNode::optimise(const Profile *profile) {
+  expr->optimise(profile);
+}
+std::string bamql::SharedNode::key() { return expr->key(); }
+void bamql::SharedNode::forEachChild(
+    const std::function<void(std::shared_ptr<AstNode> &)> &function) {
+  function(expr);
+}
+void bamql::SharedNode::writeDebug(GenerateState &state) {}
+
+void bamql::shareCommonSubexpressions(std::shared_ptr<AstNode> &root) {
+  std::vector<std::shared_ptr<AstNode>> roots = { root };
+  shareCommonSubexpressions(roots);
+  root = roots.front();
+}
+
+void bamql::shareCommonSubexpressions(
+    std::vector<std::shared_ptr<AstNode>> &roots) {
+  /* Count the uses of every subexpression. The children of a repeated
+   * subexpression are only counted once, since it will only be evaluated
+   * once. A node that is already shared is counted through its child. */
+  std::map<std::string, size_t> uses;
+  std::function<void(std::shared_ptr<AstNode> &)> count =
+      [&](std::shared_ptr<AstNode> &node) {
+        auto key = node->key();
+        if (std::dynamic_pointer_cast<SharedNode>(node)) {
+          node->forEachChild(count);
+          return;
+        }
+        if (!key.empty() && uses[key]++ > 0) {
+          return;
+        }
+        node->forEachChild(count);
+      };
+  for (auto it = roots.begin(); it != roots.end(); it++) {
+    count(*it);
+  }
+
+  /* Replace every use of a repeated subexpression with the same shared node.
+   * Checking the flags is cheaper than checking whether they have been
+   * checked, so only more expensive nodes are shared. */
+  std::map<std::string, std::shared_ptr<AstNode>> shared;
+  std::function<void(std::shared_ptr<AstNode> &)> replace =
+      [&](std::shared_ptr<AstNode> &node) {
+        auto key = node->key();
+        bool is_shared = std::dynamic_pointer_cast<SharedNode>(node) != nullptr;
+        if (!is_shared && (key.empty() || uses[key] < 2 || node->cost() < 2)) {
+          node->forEachChild(replace);
+          return;
+        }
+        auto &existing = shared[key];
+        if (!existing) {
+          if (is_shared) {
+            existing = node;
+          } else {
+            node->forEachChild(replace);
+            existing = std::make_shared<SharedNode>(node);
+          }
+        }
+        node = existing;
+      };
+  for (auto it = roots.begin(); it != roots.end(); it++) {
+    replace(*it);
+  }
+}
@@ -15,10 +15,15 @@
  */
 
 #pragma once
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
 #include <bamql.hpp>
 #include <htslib/hts.h>
 #include <htslib/sam.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
 
 namespace bamql {
 
@@ -32,6 +37,11 @@ typedef bool (*FilterFunction)(bam_hdr_t *, bam1_t *);
  */
 typedef bool (*IndexFunction)(bam_hdr_t *, uint32_t);
 
+/**
+ * The run-time type of a filter over many reads.
+ */
+typedef void (*BatchFunction)(bam_hdr_t *, bam1_t **, size_t, uint8_t *);
+
 /**
  * Call the JITer on a function and return it as the correct type.
  */
@@ -48,9 +58,96 @@ T getNativeFunction(std::shared_ptr<llvm::ExecutionEngine> &engine,
 
 /**
  * Create a JIT.
+ * @param portable: if true, generate code for a generic processor, without
+ * AVX, instead of using every feature of the host processor. This is needed to
+ * run under Valgrind.
+ * @param cache: if true, reuse machine code from the on-disk cache when the
+ * same module has been compiled before, and store it there otherwise.
  */
 std::shared_ptr<llvm::ExecutionEngine> createEngine(
-    std::unique_ptr<llvm::Module> module);
+    std::unique_ptr<llvm::Module> module,
+    bool portable = false,
+    bool cache = true);
+/**
+ * Create a JIT for a module given as bitcode. The module is loaded into an
+ * LLVM context of its own, which is freed along with the engine, so, unlike a
+ * module in the global context, it can be compiled on any thread while other
+ * threads are using LLVM.
+ */
+std::shared_ptr<llvm::ExecutionEngine> createEngine(const std::string &bitcode,
+                                                    bool portable = false,
+                                                    bool cache = true);
+
+/**
+ * Load a shared library containing queries compiled by `bamql-compile`.
+ * @return: a handle to the library which will be unloaded when no references
+ * remain, or null on error.
+ */
+std::shared_ptr<void> openLibrary(const char *file_name);
+
+/**
+ * Find a compiled query in a shared library.
+ * @param name: the name of the query, as defined in the query file.
+ * @param filter: the filter function for the query.
+ * @param index: the index checker for the query.
+ * @param batch: the batch filter function for the query, or null if the
+ * library does not provide one.
+ * @return: whether the filter and index checker were found.
+ */
+bool findLibraryQuery(std::shared_ptr<void> &library,
+                      const std::string &name,
+                      FilterFunction &filter,
+                      IndexFunction &index,
+                      BatchFunction &batch);
+
+/**
+ * The directory where compiled queries are cached. This is `BAMQL_CACHE_DIR`,
+ * if set, otherwise a `bamql` directory in the user's cache directory. If no
+ * suitable directory can be found, it is empty.
+ */
+std::string getCacheDirectory();
+
+/**
+ * Remove all compiled queries from the on-disk cache.
+ * @return: whether every cached object could be deleted.
+ */
+bool clearCache();
+
+/**
+ * Store the machine code generated by the JIT on disk, so that compiling the
+ * same query again, with the same versions of LLVM and BAMQL, for the same
+ * processor, can be skipped.
+ *
+ * The total size of the cache is limited to `BAMQL_CACHE_SIZE` megabytes; the
+ * least recently used objects are discarded first.
+ */
+class DiskObjectCache : public llvm::ObjectCache {
+public:
+  /**
+   * @param target: a description of the processor and features the code is
+   * generated for.
+   */
+  DiskObjectCache(const std::string &target);
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 5
+  virtual void notifyObjectCompiled(const llvm::Module *module,
+                                    const llvm::MemoryBuffer *obj);
+  virtual llvm::MemoryBuffer *getObject(const llvm::Module *module);
+#else
+  virtual void notifyObjectCompiled(const llvm::Module *module,
+                                    llvm::MemoryBufferRef obj);
+  virtual std::unique_ptr<llvm::MemoryBuffer> getObject(
+      const llvm::Module *module);
+#endif
+
+private:
+  std::string getPath(const llvm::Module *module);
+  void prune();
+
+  std::string directory;
+  std::string target;
+  off_t max_size;
+  std::map<const llvm::Module *, std::string> paths;
+};
 
 /**
  * Iterator over all the reads in a BAM file, using an index if possible.
@@ -63,11 +160,28 @@ public:
    */
   virtual bool wantChromosome(std::shared_ptr<bam_hdr_t> &header,
                               uint32_t tid) = 0;
+  /**
+   * Should only the reads overlapping some positions on this chromosome be
+   * examined? This is only used with an index. By default, every position is
+   * wanted.
+   * @param ranges: set to the positions wanted, normalised.
+   */
+  virtual bool wantPositions(std::shared_ptr<bam_hdr_t> &header,
+                             uint32_t tid,
+                             PositionRanges &ranges);
   /**
    * Examine a read.
    */
   virtual void processRead(std::shared_ptr<bam_hdr_t> &header,
                            std::shared_ptr<bam1_t> &read) = 0;
+  /**
+   * Examine several consecutive reads. By default, each read is given to
+   * `processRead`.
+   * @param count: the number of reads in the batch to examine.
+   */
+  virtual void processBatch(std::shared_ptr<bam_hdr_t> &header,
+                            std::vector<std::shared_ptr<bam1_t>> &reads,
+                            size_t count);
   /**
    * Examine the header of a new file.
    */
@@ -92,10 +206,57 @@ public:
                 std::shared_ptr<Generator> &generator,
                 std::shared_ptr<AstNode> &node,
                 std::string name);
+  /**
+   * Generate a query into a module that does not have an execution engine
+   * yet. The engine is created by `compileInBackground`.
+   * @param portable: as for `createEngine`.
+   * @param cache: as for `createEngine`.
+   */
+  CheckIterator(std::unique_ptr<llvm::Module> module,
+                std::shared_ptr<Generator> &generator,
+                std::shared_ptr<AstNode> &node,
+                std::string name,
+                bool portable,
+                bool cache);
+  /**
+   * Use a query that has already been compiled to native code.
+   * @param library: the object containing the functions, which must be kept
+   * alive as long as they are in use.
+   */
+  CheckIterator(std::shared_ptr<void> &library,
+                FilterFunction filter,
+                IndexFunction index,
+                BatchFunction batch);
+  virtual ~CheckIterator();
+  /**
+   * Link the runtime library and compile the query on another thread. Until
+   * the native code is ready, reads are examined by evaluating the query
+   * directly, which is slower, but allows work to start immediately. If the
+   * query cannot be interpreted, it is compiled before returning. Either way,
+   * the caller must not link or finalize the module itself. If the iterator
+   * is freed before the compiler is done, the remaining steps are skipped.
+   * @return false if the query cannot be interpreted and compiling it failed.
+   */
+  bool compileInBackground();
+  /**
+   * Once some reads have been examined, reorder the query using what was
+   * observed about them, recompile it, and switch to the new code. The
+   * generator given to the constructor must have a profile.
+   * @param reads: the number of reads to examine before recompiling.
+   * @param portable: as for `createEngine`.
+   * @param cache: as for `createEngine`.
+   */
+  void adaptAfter(size_t reads, bool portable, bool cache);
   virtual void prepareExecution();
   virtual bool wantChromosome(std::shared_ptr<bam_hdr_t> &header, uint32_t tid);
+  virtual bool wantPositions(std::shared_ptr<bam_hdr_t> &header,
+                             uint32_t tid,
+                             PositionRanges &ranges);
   virtual void processRead(std::shared_ptr<bam_hdr_t> &header,
                            std::shared_ptr<bam1_t> &read);
+  virtual void processBatch(std::shared_ptr<bam_hdr_t> &header,
+                            std::vector<std::shared_ptr<bam1_t>> &reads,
+                            size_t count);
   virtual void ingestHeader(std::shared_ptr<bam_hdr_t> &header) = 0;
   /**
    * After filtering, do something useful with a read based on whether it
@@ -109,11 +270,35 @@ public:
                          std::shared_ptr<bam1_t> &read) = 0;
 
 private:
+  struct Compilation;
+  void createFunctions(std::shared_ptr<Generator> &generator);
+  void countReads(size_t count);
+  /**
+   * Determine if the query must still be interpreted. Once the background
+   * compilation has finished, this switches to the native code.
+   */
+  bool useInterpreter();
+
   bamql::FilterFunction filter;
   bamql::IndexFunction index;
+  bamql::BatchFunction batch;
   llvm::Function *filter_func;
   llvm::Function *index_func;
+  llvm::Function *batch_func;
   std::shared_ptr<llvm::ExecutionEngine> engine;
+  std::shared_ptr<void> library;
+  std::vector<bam1_t *> batch_reads;
+  std::vector<uint8_t> batch_matches;
+  std::shared_ptr<Generator> generator;
+  std::shared_ptr<AstNode> node;
+  std::string name;
+  size_t adapt_after = 0;
+  size_t reads_seen = 0;
+  bool adapt_portable = false;
+  bool adapt_cache = true;
+  std::thread compiler;
+  std::shared_ptr<Compilation> compilation;
+  bool interpreting = false;
 };
 
 /**
@@ -19,6 +19,9 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <string>
+#include <vector>
+#include <htslib/sam.h>
 #include <llvm/Config/config.h>
 #if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 4
 #include <llvm/DIBuilder.h>
@@ -28,6 +31,8 @@
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Module.h>
 
+struct bamql_read_context;
+
 namespace bamql {
 
 /**
@@ -40,6 +45,13 @@ llvm::Type *getBamType(llvm::Module *module);
  */
 llvm::Type *getBamHeaderType(llvm::Module *module);
 
+/**
+ * Copy the runtime library functions used by the generated code into a
+ * module. This must be done after all code has been generated and before the
+ * module is compiled.
+ */
+void linkRuntime(llvm::Module *module);
+
 /**
  * The exception thrown when a parse error occurs.
  */
@@ -58,6 +70,7 @@ private:
 class AstNode;
 class ParseState;
 class GenerateState;
+class Profile;
 
 /**
  * A predicate is a function that parses a named predicate, and, upon success,
@@ -80,18 +93,49 @@ typedef std::map<std::string, Predicate> PredicateMap;
  */
 PredicateMap getDefaultPredicates();
 
+/**
+ * A list of 1-based, inclusive ranges of positions on a chromosome.
+ */
+typedef std::vector<std::pair<int32_t, int32_t>> PositionRanges;
+/**
+ * Sort a list of ranges and merge the ones that overlap or touch.
+ */
+void normaliseRanges(PositionRanges &ranges);
+/**
+ * Find the positions in both of two normalised lists of ranges.
+ */
+PositionRanges intersectRanges(const PositionRanges &a,
+                               const PositionRanges &b);
+/**
+ * Ranges of positions on several chromosomes. The chromosome names have no
+ * `chr` prefix and are in lower case; the empty name stands for every
+ * chromosome.
+ */
+typedef std::map<std::string, PositionRanges> RegionMap;
+
 class Generator {
 public:
-  Generator(llvm::Module *module, llvm::DIScope *debug_scope);
+  /**
+   * @param profile: if not null, the generated code will count how often the
+   * parts of the query are true in this profile. Such code can only be run in
+   * this process and must not be cached.
+   */
+  Generator(llvm::Module *module,
+            llvm::DIScope *debug_scope,
+            std::shared_ptr<Profile> profile = nullptr);
 
   llvm::Module *module() const;
   llvm::DIScope *debugScope() const;
+  Profile *profile() const;
   llvm::Value *createString(std::string &str);
+  llvm::Value *createArray(llvm::Constant *array);
 
 private:
   llvm::Module *mod;
   llvm::DIScope *debug_scope;
+  std::shared_ptr<Profile> prof;
   std::map<std::string, llvm::Value *> constant_pool;
+  std::map<llvm::Constant *, llvm::Value *> array_pool;
 };
 class GenerateState {
 public:
@@ -100,6 +144,32 @@ public:
   llvm::IRBuilder<> *operator->();
   llvm::Module *module() const;
   llvm::DIScope *debugScope() const;
+  Profile *profile() const;
+  /**
+   * Start a new block for the code that examines a read. It must be executed
+   * once for every read examined.
+   * @param read: the BAM read, which must already be available.
+   */
+  void startRead(llvm::Value *read);
+  /**
+   * Get a variable, reset at the start of every read, to remember the result
+   * of a node: 0 if not yet evaluated, 1 if false, and 2 if true.
+   * @returns: a pointer to the variable, or null if `startRead` has not been
+   * called.
+   */
+  llvm::Value *memoSlot(AstNode *node);
+  /**
+   * Get a pointer to the value of an auxiliary field of the read, as
+   * `bam_aux_get` would return, or null if the read has no such field. All
+   * the fields used are found in a single pass over the auxiliary data.
+   */
+  llvm::Value *auxTag(llvm::Value *read, char group1, char group2);
+  /**
+   * Get a pointer to the `struct bamql_read_context` for the read, which
+   * holds values derived from the read that are computed on first use and
+   * shared by every predicate that needs them.
+   */
+  llvm::Value *readContext();
   /**
    * This helper function puts a string into a global constant and then
    * returns a pointer to it.
@@ -107,10 +177,139 @@ public:
    * One would think this is trivial, but it isn't.
    */
   llvm::Value *createString(std::string &str);
+  /**
+   * Put a constant array (e.g., from `llvm::ConstantDataArray`) into a global
+   * and return a pointer to its first element.
+   */
+  llvm::Value *createArray(llvm::Constant *array);
 
 private:
   std::shared_ptr<Generator> generator;
   llvm::IRBuilder<> builder;
+  llvm::BasicBlock *read_block;
+  llvm::Value *read_value;
+  std::map<AstNode *, llvm::Value *> memo;
+  std::string aux_tags;
+  llvm::AllocaInst *aux_values;
+  std::vector<llvm::CallInst *> aux_lookups;
+  llvm::Value *read_context;
+};
+/**
+ * Counts of how often parts of a query are evaluated, and how often they are
+ * true, collected while the query runs over real data.
+ */
+class Profile {
+public:
+  /**
+   * Generate code to count the result of evaluating a node.
+   */
+  void record(GenerateState &state, AstNode *node, llvm::Value *result);
+  /**
+   * The fraction of the times a node was evaluated that it was true, or a
+   * negative number if it was never evaluated.
+   */
+  double selectivity(AstNode *node) const;
+
+private:
+  struct Counts {
+    uint64_t evaluated;
+    uint64_t matched;
+  };
+  // The generated code holds pointers to the counts, so they must not move.
+  std::map<AstNode *, Counts> counts;
+};
+/**
+ * A PCRE regular expression without any group captures, as parsed from a
+ * query. It can be used wherever a `RegularExpression` is expected.
+ */
+struct ParsedRegEx {
+  /**
+   * Put the compiled expression into the module and return a pointer to it.
+   */
+  RegularExpression generate;
+  /**
+   * A string that must occur in any input matched by the expression, or an
+   * empty string if no such string could be determined. This is used to
+   * reject input cheaply before running the expression.
+   */
+  std::string literal;
+  /**
+   * The expression as compiled by PCRE.
+   */
+  std::vector<uint8_t> compiled;
+
+  llvm::Value *operator()(GenerateState &state) const {
+    return generate(state);
+  }
+  /**
+   * Match the expression against a string in this process.
+   */
+  bool match(const char *input, size_t length) const;
+  /**
+   * A string that is the same for any two identical expressions.
+   */
+  std::string key() const;
+};
+/**
+ * The fixed fields of a batch of reads, gathered into arrays so that
+ * predicates can be evaluated on many reads at once.
+ */
+class VectorColumns {
+public:
+  /**
+   * The number of reads evaluated at once.
+   */
+  static const unsigned int WIDTH = 16;
+  /**
+   * The most reads a batch function examines at once. Larger batches are split
+   * so that the columns can be on the stack. This must be a multiple of
+   * `WIDTH`.
+   */
+  static const unsigned int MAX_BATCH = 256;
+
+  VectorColumns(llvm::Value *header,
+                llvm::Value *reads,
+                llvm::Value *count,
+                llvm::Value *lane,
+                llvm::Instruction *gather_point);
+  /**
+   * Get the values of a field for the reads in the current lanes.
+   *
+   * The field is copied out of every read in the batch, once, by calling a
+   * runtime function with the signature:
+   *
+   * void gather_fn(bam1_t **reads, size_t count, T *out, ...)
+   *
+   * @param extra: Additional arguments for the gather function. These must
+   * be constants or arguments of the batch function.
+   * @returns: A vector of `WIDTH` values of type `T`.
+   */
+  llvm::Value *load(GenerateState &state,
+                    llvm::StringRef gather_fn,
+                    const std::vector<llvm::Value *> &extra =
+                        std::vector<llvm::Value *>());
+  /**
+   * The BAM header, for use as an argument to a gather function.
+   */
+  llvm::Value *header() const;
+  /**
+   * The number of reference sequences in the header, in every lane.
+   */
+  llvm::Value *targetCount(GenerateState &state);
+  /**
+   * Put a constant in every lane.
+   */
+  static llvm::Constant *splat(llvm::Constant *value);
+
+private:
+  llvm::Value *header_value;
+  llvm::Value *reads;
+  llvm::Value *count;
+  llvm::Value *lane;
+  llvm::IRBuilder<> gather;
+  std::map<std::pair<llvm::Function *, std::vector<llvm::Value *>>,
+           llvm::Value *> columns;
+  llvm::Value *targets;
 };
 typedef llvm::Value *(bamql::AstNode::*GenerateMember)(GenerateState &state,
                                                        llvm::Value *param,
@@ -160,6 +359,131 @@ public:
    * `generateIndex` be non-constant).
    */
   virtual bool usesIndex();
+  /**
+   * Determine if the result of `generateIndex` is always the result of
+   * `generate` for every read on that chromosome, so the query need not be
+   * evaluated for each read.
+   */
+  virtual bool indexIsExact();
+  /**
+   * Determine if this node, and all its children, can be evaluated by
+   * `evaluate` and `evaluateIndex` instead of generating code.
+   */
+  virtual bool isInterpretable();
+  /**
+   * Evaluate this syntax node on a read directly, producing the same result
+   * as the code from `generate`. This is used while the generated code is
+   * being compiled on another thread, so it must not use LLVM.
+   * @param context: the values derived from the read, which must be cleared
+   * before each read.
+   */
+  virtual bool evaluate(bam_hdr_t *header,
+                        bam1_t *read,
+                        bamql_read_context *context);
+  /**
+   * Evaluate this syntax node for a chromosome directly, producing the same
+   * result as the code from `generateIndex`.
+   */
+  virtual bool evaluateIndex(bam_hdr_t *header, uint32_t tid);
+  /**
+   * Determine if this node can be evaluated entirely from the fixed fields of
+   * the reads by `generateVector`.
+   */
+  virtual bool isVectorisable();
+  /**
+   * Determine if `generateVectorGuard` can produce a useful result.
+   */
+  virtual bool hasVectorGuard();
+  /**
+   * Render this syntax node to LLVM for many reads at once.
+   * @returns: A vector of `VectorColumns::WIDTH` booleans, or null if this
+   * node is not vectorisable.
+   */
+  virtual llvm::Value *generateVector(GenerateState &state,
+                                      VectorColumns &columns);
+  /**
+   * Render a necessary, but not sufficient, condition for this node for many
+   * reads at once. Reads that fail the guard cannot match; reads that pass
+   * must still be checked by `generate`.
+   */
+  virtual llvm::Value *generateVectorGuard(GenerateState &state,
+                                           VectorColumns &columns);
+  /**
+   * An estimate of how expensive this node is to evaluate, used to decide
+   * the order of the operands of logical operations. Constants cost 0,
+   * predicates on the flags or mapping quality 1, on the chromosome 2, on the
+   * position or regions 3, on the auxiliary data 4, on the sequence or a set of
+   * names or values 5, regular expressions 6, searches for motifs 7, and
+   * lookups in tables of variants 8.
+   */
+  virtual unsigned int cost();
+  /**
+   * Determine if evaluating this node can change the result of other nodes,
+   * or vice versa, in which case, nothing may be moved past it.
+   */
+  virtual bool hasSideEffects();
+  /**
+   * Rearrange this node and its children so they are cheaper to evaluate,
+   * without changing the result.
+   * @param profile: what was observed when running the query, or null to use
+   * only the static costs.
+   */
+  virtual void optimise(const Profile *profile);
+  /**
+   * A string that is the same for any two nodes that always produce the same
+   * result for the same read, or empty if this node must never be shared
+   * with another.
+   */
+  virtual std::string key();
+  /**
+   * Call a function on every child of this node. The function may replace
+   * the child.
+   */
+  virtual void forEachChild(
+      const std::function<void(std::shared_ptr<AstNode> &)> &function);
+  /**
+   * Produce a simpler node with the same result. The children of this node
+   * are simplified in place.
+   * @returns: the replacement node, or null to keep this node.
+   */
+  virtual std::shared_ptr<AstNode> simplified();
+  /**
+   * Determine if this node always has the same result.
+   * @param value: set to the result, if it is constant.
+   */
+  virtual bool constantValue(bool &value);
+  /**
+   * Determine if this node only checks the flags of the read, in the form
+   * `((flag & mask) == value) != negated`.
+   */
+  virtual bool flagTest(uint16_t &mask, uint16_t &value, bool &negated);
+  /**
+   * Determine if this node only checks whether the read has any of a set of
+   * nucleotides, as pairs of 1-based position and IUPAC base.
+   * @param exact: set to whether the bases must match exactly.
+   */
+  virtual bool nucleotideTest(
+      std::vector<std::pair<int32_t, unsigned char>> &sites, bool &exact);
+  /**
+   * Determine the positions on a chromosome that a read must overlap for this
+   * node to be true.
+   * @param ranges: set to the positions, normalised.
+   * @returns: whether the positions are restricted at all.
+   */
+  virtual bool positionRanges(bam_hdr_t *header,
+                              uint32_t tid,
+                              PositionRanges &ranges);
+  /**
+   * Determine if this node only checks that the read overlaps any of a set of
+   * regions, in the same way as `position`.
+   * @param regions: set to the regions, normalised.
+   */
+  virtual bool regionTest(RegionMap &regions);
+  /**
+   * Produce the complement of this node without adding a `NotNode`.
+   * @returns: the complement, or null if this isn't possible.
+   */
+  virtual std::shared_ptr<AstNode> negate();
   /**
    * Generate the LLVM function from the query.
    */
@@ -167,6 +491,20 @@ public:
                                        llvm::StringRef name);
   llvm::Function *createIndexFunction(std::shared_ptr<Generator> &generator,
                                       llvm::StringRef name);
+  /**
+   * Generate an LLVM function that applies the query to many reads. It has the
+   * signature:
+   *
+   * void name(bam_hdr_t *header, bam1_t **reads, size_t count, uint8_t *out)
+   *
+   * and, for each read, sets the corresponding output to 1 if the read
+   * matches, or 0 otherwise. Any part of the query that only examines the
+   * fixed fields of the reads is evaluated on vectors of reads first. The
+   * batch may be any size; it is examined `VectorColumns::MAX_BATCH` reads at
+   * a time, so the stack used does not depend on it.
+   */
+  llvm::Function *createBatchFunction(std::shared_ptr<Generator> &generator,
+                                      llvm::StringRef name);
 
   virtual void writeDebug(GenerateState &state) = 0;
 
@@ -193,7 +531,8 @@ private:
 
 /**
  * An abstract syntax node encompassing logical ANDs and ORs that can
- * short-circuit.
+ * short-circuit. If the right-hand side is trivially cheap, both sides are
+ * evaluated instead, since that is faster than an unpredictable branch.
  */
 class ShortCircuitNode : public AstNode {
 public:
@@ -205,20 +544,39 @@ public:
                                      llvm::Value *tid,
                                      llvm::Value *header);
   bool usesIndex();
+  bool indexIsExact();
+  bool isInterpretable();
   /**
    * The value that causes short circuting.
    */
   virtual llvm::Value *branchValue() = 0;
 
+  unsigned int cost();
+  bool hasSideEffects();
+  void optimise(const Profile *profile);
+  std::string key();
+  void forEachChild(
+      const std::function<void(std::shared_ptr<AstNode> &)> &function);
+  std::shared_ptr<AstNode> simplified();
+  std::shared_ptr<AstNode> negate();
+
   void writeDebug(GenerateState &state);
 
+protected:
+  std::shared_ptr<AstNode> left;
+  std::shared_ptr<AstNode> right;
+
 private:
+  /**
+   * Call a function on every operand of a chain of the same operation (e.g.,
+   * `a & (b & c)`) in the order they are evaluated.
+   */
+  void forEachOperand(
+      const std::function<void(std::shared_ptr<AstNode> &)> &function);
   llvm::Value *generateGeneric(GenerateMember member,
                                GenerateState &state,
                                llvm::Value *param,
                                llvm::Value *header);
-  std::shared_ptr<AstNode> left;
-  std::shared_ptr<AstNode> right;
 };
 /**
  * A syntax node for logical conjunction (AND).
@@ -227,6 +585,15 @@ class AndNode : public ShortCircuitNode {
 public:
   AndNode(std::shared_ptr<AstNode> left, std::shared_ptr<AstNode> right);
   virtual llvm::Value *branchValue();
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context);
+  bool evaluateIndex(bam_hdr_t *header, uint32_t tid);
+  bool positionRanges(bam_hdr_t *header, uint32_t tid, PositionRanges &ranges);
+  bool regionTest(RegionMap &regions);
+  bool isVectorisable();
+  bool hasVectorGuard();
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns);
+  llvm::Value *generateVectorGuard(GenerateState &state,
+                                   VectorColumns &columns);
 };
 /**
  * A syntax node for logical disjunction (OR).
@@ -235,6 +602,15 @@ class OrNode : public ShortCircuitNode {
 public:
   OrNode(std::shared_ptr<AstNode> left, std::shared_ptr<AstNode> right);
   virtual llvm::Value *branchValue();
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context);
+  bool evaluateIndex(bam_hdr_t *header, uint32_t tid);
+  bool positionRanges(bam_hdr_t *header, uint32_t tid, PositionRanges &ranges);
+  bool regionTest(RegionMap &regions);
+  bool isVectorisable();
+  bool hasVectorGuard();
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns);
+  llvm::Value *generateVectorGuard(GenerateState &state,
+                                   VectorColumns &columns);
 };
 /**
  * A syntax node for exclusive disjunction (XOR).
@@ -249,6 +625,20 @@ public:
                                      llvm::Value *tid,
                                      llvm::Value *header);
   bool usesIndex();
+  bool indexIsExact();
+  bool isInterpretable();
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context);
+  bool evaluateIndex(bam_hdr_t *header, uint32_t tid);
+  bool isVectorisable();
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns);
+  unsigned int cost();
+  bool hasSideEffects();
+  void optimise(const Profile *profile);
+  std::string key();
+  void forEachChild(
+      const std::function<void(std::shared_ptr<AstNode> &)> &function);
+  std::shared_ptr<AstNode> simplified();
+  std::shared_ptr<AstNode> negate();
 
   void writeDebug(GenerateState &state);
 
@@ -269,6 +659,20 @@ public:
                                      llvm::Value *tid,
                                      llvm::Value *header);
   bool usesIndex();
+  bool indexIsExact();
+  bool isInterpretable();
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context);
+  bool evaluateIndex(bam_hdr_t *header, uint32_t tid);
+  bool isVectorisable();
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns);
+  unsigned int cost();
+  bool hasSideEffects();
+  void optimise(const Profile *profile);
+  std::string key();
+  void forEachChild(
+      const std::function<void(std::shared_ptr<AstNode> &)> &function);
+  std::shared_ptr<AstNode> simplified();
+  std::shared_ptr<AstNode> negate();
 
   void writeDebug(GenerateState &state);
 
@@ -290,6 +694,20 @@ public:
                                      llvm::Value *tid,
                                      llvm::Value *header);
   bool usesIndex();
+  bool isInterpretable();
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context);
+  bool evaluateIndex(bam_hdr_t *header, uint32_t tid);
+  bool positionRanges(bam_hdr_t *header, uint32_t tid, PositionRanges &ranges);
+  bool isVectorisable();
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns);
+  unsigned int cost();
+  bool hasSideEffects();
+  void optimise(const Profile *profile);
+  std::string key();
+  void forEachChild(
+      const std::function<void(std::shared_ptr<AstNode> &)> &function);
+  std::shared_ptr<AstNode> simplified();
+  std::shared_ptr<AstNode> negate();
   void writeDebug(GenerateState &state);
 
 private:
@@ -297,6 +715,100 @@ private:
   std::shared_ptr<AstNode> then_part;
   std::shared_ptr<AstNode> else_part;
 };
+/**
+ * A syntax node for a subexpression that occurs more than once in a query. It
+ * is evaluated at most once per read, no matter how many times it is used.
+ */
+class SharedNode : public AstNode {
+public:
+  SharedNode(std::shared_ptr<AstNode> expr);
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header);
+  virtual llvm::Value *generateIndex(GenerateState &state,
+                                     llvm::Value *tid,
+                                     llvm::Value *header);
+  bool usesIndex();
+  bool indexIsExact();
+  bool isInterpretable();
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context);
+  bool evaluateIndex(bam_hdr_t *header, uint32_t tid);
+  bool positionRanges(bam_hdr_t *header, uint32_t tid, PositionRanges &ranges);
+  bool isVectorisable();
+  bool hasVectorGuard();
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns);
+  llvm::Value *generateVectorGuard(GenerateState &state,
+                                   VectorColumns &columns);
+  unsigned int cost();
+  bool hasSideEffects();
+  void optimise(const Profile *profile);
+  std::string key();
+  void forEachChild(
+      const std::function<void(std::shared_ptr<AstNode> &)> &function);
+  void writeDebug(GenerateState &state);
+
+private:
+  std::shared_ptr<AstNode> expr;
+};
+/**
+ * Replace every repeated subexpression in a query with a single `SharedNode`.
+ * Subexpressions that are cheaper to evaluate again than to remember, or
+ * have side effects, are left alone.
+ */
+void shareCommonSubexpressions(std::shared_ptr<AstNode> &root);
+/**
+ * Replace every subexpression repeated in or across several queries, which
+ * are evaluated on the same reads by one function, with a single
+ * `SharedNode`.
+ */
+void shareCommonSubexpressions(std::vector<std::shared_ptr<AstNode>> &roots);
+/**
+ * Simplify a node: fold constants, remove double negations, move negations
+ * inward where that removes them, and combine checks of the flags into a
+ * single comparison.
+ */
+void simplify(std::shared_ptr<AstNode> &node);
+/**
+ * How a query in a chain passes reads on to the next query. This is a bit
+ * field where the lowest bit is whether to pass on reads that don't match and
+ * the next bit is whether to pass on reads that do.
+ */
+typedef unsigned int ChainPattern;
+/**
+ * The most queries that can be evaluated as one chain.
+ */
+const size_t MAX_CHAIN_LENGTH = 64;
+/**
+ * Generate an LLVM function that evaluates a chain of queries on a read. It
+ * has the signature:
+ *
+ * uint64_t name(bam_hdr_t *header, bam1_t *read, const uint64_t *table)
+ *
+ * Bit _i_ of the result is set if the read reaches query _i_ and matches it.
+ * Subexpressions shared between queries are evaluated once. Queries whose
+ * result only depends on the chromosome are not evaluated at all; the result
+ * is looked up in the table of the chromosomes in the header, as created by
+ * `createChainDispatchFunction`, which has one entry for each target in the
+ * header followed by one for reads with no target.
+ */
+llvm::Function *createChainFunction(
+    std::shared_ptr<Generator> &generator,
+    llvm::StringRef name,
+    std::vector<std::shared_ptr<AstNode>> &queries,
+    ChainPattern pattern);
+/**
+ * Generate an LLVM function that fills in an entry of the table for the
+ * function made by `createChainFunction`. It has the signature:
+ *
+ * uint64_t name(bam_hdr_t *header, uint32_t tid)
+ *
+ * Bit _i_ of the result is set if query _i_ only depends on the chromosome
+ * and matches every read on it.
+ */
+llvm::Function *createChainDispatchFunction(
+    std::shared_ptr<Generator> &generator,
+    llvm::StringRef name,
+    std::vector<std::shared_ptr<AstNode>> &queries);
 class ParseState {
 public:
   ParseState(const std::string &input);
@@ -340,10 +852,15 @@ public:
    * possibilities.
    */
   unsigned char parseNucleotide();
+  /**
+   * Parse a file name. It may be in double quotes; otherwise, it ends at
+   * whitespace, a comma, or a closing parenthesis.
+   */
+  std::string parsePath() throw(ParseError);
   /**
    * Match a PCRE regular expression without any group captures.
    */
-  RegularExpression parseRegEx() throw(ParseError);
+  ParsedRegEx parseRegEx() throw(ParseError);
 
   /**
   * Return the substring starting from the position to provided to the current
@@ -372,4 +889,12 @@ private:
  * The current version of the library.
  */
 std::string version();
+
+/**
+ * Get the features supported by the host's processor (e.g., vector
+ * instruction sets) in the form LLVM uses for target attributes (e.g.,
+ * `+avx2,-avx512f`). If the features cannot be determined, the result is
+ * empty and only the processor name should be used.
+ */
+std::string getHostCPUFeatures();
 }
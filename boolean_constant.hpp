@@ -21,6 +21,14 @@
 namespace bamql {
 typedef llvm::ConstantInt *(*BoolConstant)(llvm::LLVMContext &);
 
+/**
+ * Determine the value of a boolean constant without using the LLVM context,
+ * which may be in use by the compiler on another thread.
+ */
+template <BoolConstant CF> bool isTrue() {
+  return CF == static_cast<BoolConstant>(llvm::ConstantInt::getTrue);
+}
+
 /**
  * A predicate that always returns a constant.
  */
@@ -36,6 +44,31 @@ public:
                              llvm::Value *header) {
     return CF(llvm::getGlobalContext());
   }
+  bool indexIsExact() { return true; }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return isTrue<CF>();
+  }
+  bool evaluateIndex(bam_hdr_t *header, uint32_t tid) { return isTrue<CF>(); }
+  bool isVectorisable() { return true; }
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns) {
+    return VectorColumns::splat(CF(llvm::getGlobalContext()));
+  }
+  std::string key() {
+    return CF(llvm::getGlobalContext())->isOne() ? "true" : "false";
+  }
+  unsigned int cost() { return 0; }
+  bool constantValue(bool &value) {
+    value = CF(llvm::getGlobalContext())->isOne();
+    return true;
+  }
+  std::shared_ptr<AstNode> negate() {
+    if (CF(llvm::getGlobalContext())->isOne()) {
+      return std::make_shared<ConstantNode<llvm::ConstantInt::getFalse>>();
+    } else {
+      return std::make_shared<ConstantNode<llvm::ConstantInt::getTrue>>();
+    }
+  }
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     static auto result = std::make_shared<ConstantNode<CF>>();
     return result;
@@ -0,0 +1,264 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <utime.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include "bamql-jit.hpp"
+
+/**
+ * The default maximum size of the cache, in megabytes.
+ */
+#define DEFAULT_CACHE_SIZE 100
+
+/**
+ * The size, in bytes, above which a constant array is hashed directly, rather
+ * than printed, when computing the key of a module.
+ */
+#define LARGE_CONSTANT 4096
+
+/**
+ * Create a directory and any missing parents.
+ */
+static bool makeDirectories(const std::string &path) {
+  for (size_t slash = path.find('/', 1); true;
+       slash = path.find('/', slash + 1)) {
+    auto prefix = path.substr(0, slash);
+    if (mkdir(prefix.c_str(), 0700) != 0 && errno != EEXIST) {
+      return false;
+    }
+    if (slash == std::string::npos) {
+      return true;
+    }
+  }
+}
+
+/**
+ * Determine if a file name looks like a cached object.
+ */
+static bool isCacheEntry(const char *name) {
+  size_t length = strlen(name);
+  return length > 2 && strcmp(name + length - 2, ".o") == 0;
+}
+
+std::string bamql::getCacheDirectory() {
+  const char *dir = getenv("BAMQL_CACHE_DIR");
+  if (dir != nullptr && *dir != '\0') {
+    return std::string(dir);
+  }
+  dir = getenv("XDG_CACHE_HOME");
+  if (dir != nullptr && *dir != '\0') {
+    return std::string(dir) + "/bamql";
+  }
+  dir = getenv("HOME");
+  if (dir != nullptr && *dir != '\0') {
+    return std::string(dir) + "/.cache/bamql";
+  }
+  return std::string();
+}
+
+bool bamql::clearCache() {
+  auto path = getCacheDirectory();
+  if (path.empty()) {
+    return true;
+  }
+  auto dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return errno == ENOENT;
+  }
+  bool success = true;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    if (isCacheEntry(entry->d_name)) {
+      auto file_name = path + "/" + entry->d_name;
+      success &= unlink(file_name.c_str()) == 0 || errno == ENOENT;
+    }
+  }
+  closedir(dir);
+  return success;
+}
+
+bamql::DiskObjectCache::DiskObjectCache(const std::string &target_)
+    : directory(getCacheDirectory()), target(target_) {
+  const char *size = getenv("BAMQL_CACHE_SIZE");
+  max_size = (size == nullptr || *size == '\0' ? DEFAULT_CACHE_SIZE
+                                                : strtoul(size, nullptr, 10)) *
+             1024 * 1024;
+}
+
+std::string bamql::DiskObjectCache::getPath(const llvm::Module *module) {
+  auto it = paths.find(module);
+  if (it != paths.end()) {
+    return it->second;
+  }
+  // The key must change whenever anything that could change the generated
+  // machine code does, so the complete IR is hashed along with the versions of
+  // everything involved in code generation.
+  //
+  // Large constant tables, such as the sets of names from `name_in`, would
+  // make the printed IR many times larger than the tables themselves, so
+  // their contents are hashed directly and a copy of the module, with the
+  // tables printed as zeros, is hashed instead. The module being compiled is
+  // never changed. Constant data is shared by all the modules in a context,
+  // so the copy does not duplicate the tables.
+  llvm::MD5 hash;
+  std::vector<const llvm::GlobalVariable *> tables;
+  for (auto it = module->global_begin(); it != module->global_end(); it++) {
+    auto data =
+        it->hasInitializer()
+            ? llvm::dyn_cast<llvm::ConstantDataSequential>(it->getInitializer())
+            : nullptr;
+    if (data != nullptr && data->getRawDataValues().size() >= LARGE_CONSTANT) {
+      hash.update(data->getRawDataValues());
+      tables.push_back(&*it);
+    }
+  }
+  std::unique_ptr<llvm::Module> copy;
+  if (!tables.empty()) {
+    llvm::ValueToValueMapTy map;
+    copy.reset(llvm::CloneModule(module, map));
+    for (auto it = tables.begin(); it != tables.end(); it++) {
+      llvm::cast<llvm::GlobalVariable>(map[*it])->setInitializer(
+          llvm::ConstantAggregateZero::get((*it)->getInitializer()->getType()));
+    }
+  }
+
+  std::string text;
+  llvm::raw_string_ostream stream(text);
+  stream << "LLVM " << LLVM_VERSION_MAJOR << "." << LLVM_VERSION_MINOR
+         << "\nBAMQL " << version() << "\nTarget " << target << "\n";
+  (copy ? copy.get() : module)->print(stream, nullptr);
+  stream.flush();
+
+  hash.update(text);
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+  llvm::SmallString<32> digest;
+  llvm::MD5::stringifyResult(result, digest);
+  auto path = directory + "/" + digest.str().str() + ".o";
+  paths[module] = path;
+  return path;
+}
+
+void bamql::DiskObjectCache::prune() {
+  auto dir = opendir(directory.c_str());
+  if (dir == nullptr) {
+    return;
+  }
+  std::vector<std::tuple<time_t, off_t, std::string>> entries;
+  off_t total = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    struct stat info;
+    if (!isCacheEntry(entry->d_name)) {
+      continue;
+    }
+    auto file_name = directory + "/" + entry->d_name;
+    if (stat(file_name.c_str(), &info) == 0) {
+      entries.push_back(
+          std::make_tuple(info.st_mtime, info.st_size, file_name));
+      total += info.st_size;
+    }
+  }
+  closedir(dir);
+
+  // Discard the least recently used objects until the cache fits.
+  std::sort(entries.begin(), entries.end());
+  for (auto it = entries.begin(); it != entries.end() && total > max_size;
+       it++) {
+    if (unlink(std::get<2>(*it).c_str()) == 0) {
+      total -= std::get<1>(*it);
+    }
+  }
+}
+
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 5
+void bamql::DiskObjectCache::notifyObjectCompiled(const llvm::Module *module,
+                                                  const llvm::MemoryBuffer *obj)
+#else
+void bamql::DiskObjectCache::notifyObjectCompiled(const llvm::Module *module,
+                                                  llvm::MemoryBufferRef obj)
+#endif
+{
+  if (directory.empty() || max_size == 0 || !makeDirectories(directory)) {
+    return;
+  }
+  auto path = getPath(module);
+  // Write to a temporary file and move it into place so that concurrent
+  // processes, or threads, never see a partially written object.
+  std::stringstream temp_path;
+  temp_path << path << "." << getpid() << "." << std::this_thread::get_id()
+            << ".tmp";
+  {
+    std::ofstream output(temp_path.str(), std::ios::binary);
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 5
+    output.write(obj->getBufferStart(), obj->getBufferSize());
+#else
+    output.write(obj.getBufferStart(), obj.getBufferSize());
+#endif
+    output.close();
+    if (!output) {
+      unlink(temp_path.str().c_str());
+      return;
+    }
+  }
+  if (rename(temp_path.str().c_str(), path.c_str()) != 0) {
+    unlink(temp_path.str().c_str());
+    return;
+  }
+  prune();
+}
+
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 5
+llvm::MemoryBuffer *
+#else
+std::unique_ptr<llvm::MemoryBuffer>
+#endif
+bamql::DiskObjectCache::getObject(const llvm::Module *module) {
+  if (directory.empty()) {
+    return nullptr;
+  }
+  auto path = getPath(module);
+  std::ifstream input(path, std::ios::binary);
+  if (!input) {
+    return nullptr;
+  }
+  std::string contents((std::istreambuf_iterator<char>(input)),
+                       std::istreambuf_iterator<char>());
+  if (contents.empty()) {
+    return nullptr;
+  }
+  // Mark the object as recently used so it survives pruning.
+  utime(path.c_str(), nullptr);
+  return llvm::MemoryBuffer::getMemBufferCopy(contents, path);
+}
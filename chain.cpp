@@ -0,0 +1,139 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#include "bamql.hpp"
+
+namespace bamql {
+
+llvm::Function *createChainFunction(
+    std::shared_ptr<Generator> &generator,
+    llvm::StringRef name,
+    std::vector<std::shared_ptr<AstNode>> &queries,
+    ChainPattern pattern) {
+  auto mask_type = llvm::Type::getInt64Ty(llvm::getGlobalContext());
+  auto func =
+      llvm::cast<llvm::Function>(generator->module()->getOrInsertFunction(
+          name,
+          mask_type,
+          llvm::PointerType::get(bamql::getBamHeaderType(generator->module()),
+                                 0),
+          llvm::PointerType::get(bamql::getBamType(generator->module()), 0),
+          llvm::PointerType::get(mask_type, 0),
+          nullptr));
+
+  auto entry =
+      llvm::BasicBlock::Create(llvm::getGlobalContext(), "entry", func);
+  auto exit = llvm::BasicBlock::Create(llvm::getGlobalContext(), "exit", func);
+  GenerateState state(generator, entry);
+  auto args = func->arg_begin();
+  auto header_value = args++;
+  header_value->setName("header");
+  auto read_value = args++;
+  read_value->setName("read");
+  auto table_value = args++;
+  table_value->setName("table");
+  state.startRead(read_value);
+
+  // Every query that only depends on the chromosome is answered by the same
+  // entry in the table.
+  llvm::Value *known = nullptr;
+  for (auto it = queries.begin(); it != queries.end(); it++) {
+    if ((*it)->indexIsExact()) {
+      known = state->CreateCall3(
+          generator->module()->getFunction("bamql_chain_dispatch"),
+          table_value,
+          header_value,
+          read_value);
+      break;
+    }
+  }
+
+  auto zero = llvm::ConstantInt::get(mask_type, 0);
+  llvm::Value *result = zero;
+  std::vector<std::pair<llvm::BasicBlock *, llvm::Value *>> results;
+  for (size_t it = 0; it < queries.size(); it++) {
+    auto bit = llvm::ConstantInt::get(mask_type, 1ULL << it);
+    llvm::Value *matches;
+    if (queries[it]->indexIsExact()) {
+      matches = state->CreateICmpNE(state->CreateAnd(known, bit), zero);
+    } else {
+      queries[it]->writeDebug(state);
+      matches = queries[it]->generate(state, read_value, header_value);
+    }
+    result = state->CreateOr(result, state->CreateSelect(matches, bit, zero));
+    if (it + 1 == queries.size() || (pattern & 3) == 3) {
+      continue;
+    }
+    // The read only goes on to the next query for one outcome of this one.
+    auto next =
+        llvm::BasicBlock::Create(llvm::getGlobalContext(), "next", func);
+    results.push_back(std::make_pair(state->GetInsertBlock(), result));
+    state->CreateCondBr(
+        matches, pattern & 2 ? next : exit, pattern & 2 ? exit : next);
+    state->SetInsertPoint(next);
+  }
+  results.push_back(std::make_pair(state->GetInsertBlock(), result));
+  state->CreateBr(exit);
+
+  state->SetInsertPoint(exit);
+  auto phi = state->CreatePHI(mask_type, results.size());
+  for (auto it = results.begin(); it != results.end(); it++) {
+    phi->addIncoming(it->second, it->first);
+  }
+  state->CreateRet(phi);
+  return func;
+}
+
+llvm::Function *createChainDispatchFunction(
+    std::shared_ptr<Generator> &generator,
+    llvm::StringRef name,
+    std::vector<std::shared_ptr<AstNode>> &queries) {
+  auto mask_type = llvm::Type::getInt64Ty(llvm::getGlobalContext());
+  auto func =
+      llvm::cast<llvm::Function>(generator->module()->getOrInsertFunction(
+          name,
+          mask_type,
+          llvm::PointerType::get(bamql::getBamHeaderType(generator->module()),
+                                 0),
+          llvm::Type::getInt32Ty(llvm::getGlobalContext()),
+          nullptr));
+
+  auto entry =
+      llvm::BasicBlock::Create(llvm::getGlobalContext(), "entry", func);
+  GenerateState state(generator, entry);
+  auto args = func->arg_begin();
+  auto header_value = args++;
+  header_value->setName("header");
+  auto tid_value = args++;
+  tid_value->setName("tid");
+
+  auto zero = llvm::ConstantInt::get(mask_type, 0);
+  llvm::Value *result = zero;
+  for (size_t it = 0; it < queries.size(); it++) {
+    if (!queries[it]->indexIsExact()) {
+      continue;
+    }
+    queries[it]->writeDebug(state);
+    auto matches = queries[it]->generateIndex(state, tid_value, header_value);
+    result = state->CreateOr(
+        result,
+        state->CreateSelect(
+            matches, llvm::ConstantInt::get(mask_type, 1ULL << it), zero));
+  }
+  state->CreateRet(result);
+  return func;
+}
+}
@@ -23,6 +23,7 @@
 #include <llvm/Support/TargetSelect.h>
 #include "bamql.hpp"
 #include "bamql-jit.hpp"
+#include "runtime.h"
 
 /*
  * Each pair is a query and the names of the sequences from test.sam that
@@ -31,9 +32,47 @@
 std::vector<std::pair<std::string, std::set<std::string>>> queries = {
   { "mapping_quality(0.5)", { "E", "F" } },
   { "before(10060)", { "A", "B", "C", "D" } },
-  { "nt(10360, A)", { "E", "F" } },
-  { "nt(10360, R)", { "E", "F" } },
-  { "nt_exact(10360, R)", {} },
+  { "nt(10360, C)", { "E", "F" } },
+  { "nt(10360, Y)", { "E", "F" } },
+  { "nt(10360, R)", {} },
+  { "nt_exact(10360, Y)", {} },
+  { "nt_exact(10360, C)", { "E", "F" } },
+  { "nt(10380, C)", { "E", "F", "G", "H" } },
+  { "nt(10433, N)", { "H" } },
+  { "nt(10437, T)", { "H", "I" } },
+  { "nt(10360, C) | nt(11330, T)", { "E", "F", "J" } },
+  { "nt_any(11330, T, 10360, C)", { "E", "F", "J" } },
+  { "nt_exact_any(10433, N, 10437, T)", { "H", "I" } },
+  { "nt(10433, A) | nt_exact(10437, T)", { "H", "I" } },
+  { "motif(GGCRCGCC)", { "J" } },
+  { "motif(GGCGTGCC)", {} },
+  { "motif_either(GGCGTGCC)", { "J" } },
+  { "motif(TAACCCC)", { "B", "E", "F", "G", "H", "I" } },
+  { "motif_either(TTAGGG) & !motif(TTAGGG)",
+    { "A", "B", "C", "D", "E", "F", "G", "H", "I" } },
+  { "gc(0.55, 1)", { "D", "G", "J" } },
+  { "gc(0, 0.5)", { "C", "I" } },
+  { "n_count(0)", { "A", "B", "C", "D", "E", "F", "G", "H", "I", "J" } },
+  { "homopolymer(4)", { "B", "E", "F", "G", "H", "I" } },
+  { "homopolymer(4) & gc(0.52, 0.53) & n_count(2)", { "B", "E", "F" } },
+  { "!homopolymer(4) & gc(0.55, 1)", { "D", "J" } },
+  { "gc(0.5131578, 1) & !gc(0.5131580, 1)", { "A", "H" } },
+  { "alt_allele(test.vcf)", { "E", "F", "G", "H", "I" } },
+  { "alt_allele(\"test.vcf\") & !chr(12)", { "E", "I" } },
+  { "region(test.bed)", { "A", "B", "C", "J" } },
+  { "region(test.bed) & chr(12)", { "J" } },
+  { "name_in(test.names)", { "C", "J" } },
+  { "aux_in(RG, \"test.rg\")", { "E", "F", "G" } },
+  { "name_in(test.names) | aux_in(RG, test.rg)", { "C", "E", "F", "G", "J" } },
+  { "name_in_bam(test.sam)",
+    { "A", "B", "C", "D", "E", "F", "G", "H", "I", "J" } },
+  { "name_in_bam(test.sam, chr(12) & read1?)", { "F", "J" } },
+  { "name_in_bam(\"test.sam\", read2?) & !chr(12)", { "E" } },
+  { "chr(1) & position(10051, 10055) | chr(12) & position(11401, 11500)",
+    { "A", "B", "C", "J" } },
+  { "position(10060, 10070) & chr(1) | chr(2) & after(10400)",
+    { "A", "B", "C", "D", "I" } },
+  { "chr(2) & (after(10400) | after(10500))", { "I" } },
   { "paired?", { "A", "B", "C", "D", "E", "F", "G", "H", "I", "J" } },
   { "mate_unmapped?", {} },
   { "split_pair?", { "C", "D", "G" } },
@@ -44,19 +83,58 @@ std::vector<std::pair<std::string, std::set<std::string>>> queries = {
   { "aux_str(MD, 51)", { "D" } },
   { "aux_char(XC, b)", { "G" } },
   { "aux_dbl(XB, 3.1)", { "C", "D" } },
+  { "aux_dbl(XB, 3.2) & !aux_dbl(XB, 3.2000004)", { "B" } },
+  { "(read1? & !mapped_to_reverse?) | (read2? & mapped_to_reverse?)",
+    { "A", "B", "C", "D", "E", "F", "H", "I", "J" } },
+  { "read1? then mapped_to_reverse? else !mapped_to_reverse?", { "G" } },
+  { "aux_int(NM, 0) & aux_char(XC, c) | aux_dbl(XB, 3.2)", { "B", "J" } },
+  { "read_group(C3C1A.1) & aux_int(NM, 0) & !aux_str(MD, 58)", { "D", "H" } },
   { "chr(1)", { "A", "B", "C", "D", "E" } },
   { "chr(*2)", { "F", "G", "H", "I", "J" } },
   { "chr(1*)", { "A", "B", "C", "D", "E", "F", "G", "H", "J" } },
   { "mate_chr(1)", { "A", "B", "E", "G" } },
   { "header ~ /A/", { "A" } },
+  { "header ~ /^[BC]$/", { "B", "C" } },
+  { "header ~ /D|E/", { "D", "E" } },
+  { "header ~ /AB+/", {} },
   { "read_group(C3BUK.1) then chr(2) else chr(12)", { "F", "G", "H" } },
   { "read_group(C3BUK.1) then chr(1) else chr(2)", { "A", "I" } },
   { "!chr(1)", { "F", "G", "H", "I", "J" } },
   { "chr(1*) | chr(*2)", { "A", "B", "C", "D", "E", "F", "G", "H", "I", "J" } },
   { "chr(1*) & chr(*2)", { "F", "G", "H", "J" } },
-  { "chr(1*) ^ chr(*2)", { "A", "B", "C", "D", "E", "I" } }
+  { "chr(1*) ^ chr(*2)", { "A", "B", "C", "D", "E", "I" } },
+  { "mapping_quality(0.5) & !chr(1)", { "F" } },
+  { "paired? & before(10060)", { "A", "B", "C", "D" } },
+  { "chr(1) & header ~ /[AF]/", { "A" } },
+  { "header ~ /[AF]/ & paired?", { "A", "F" } },
+  { "(header ~ /[AF]/ | chr(*2)) & !chr(1*)", { "I" } },
+  { "(chr(1) & paired?) | (chr(1) & read1?)", { "A", "B", "C", "D", "E" } },
+  { "header ~ /[AF]/ & (chr(2) | header ~ /[AF]/)", { "A", "F" } },
+  { "paired? & !secondary? & !supplementary? & !duplicate?",
+    { "A", "C", "D", "E", "F", "G", "H", "I", "J" } },
+  { "!(!paired? | !read1?)", { "A", "B", "C", "D", "F", "I", "J" } },
+  { "read1? & read2?", {} },
+  { "(true & mapped_to_reverse?) | false", { "E", "H" } },
+  { "random(1)", { "A", "B", "C", "D", "E", "F", "G", "H", "I", "J" } },
+  { "random(0)", {} },
+  { "random(0.5)", { "B", "E", "F", "G", "H" } },
+  { "random(0.5, 42)", { "D", "E", "J" } }
 };
 
+/*
+ * Determine if a read was correctly matched or not matched by a query.
+ */
+static bool checkMatch(int index, bool matches, std::shared_ptr<bam1_t> &read) {
+  if (matches !=
+      (queries[index].second.count(std::string(bam_get_qname(read))) == 1)) {
+    std::cerr << queries[index].first << " is " << (matches ? "" : "not ")
+              << "matching " << bam_get_qname(read) << " and that's wrong."
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
 class Checker : public bamql::CheckIterator {
 public:
   Checker(std::shared_ptr<llvm::ExecutionEngine> &engine,
@@ -70,13 +148,7 @@ public:
   void readMatch(bool matches,
                  std::shared_ptr<bam_hdr_t> &header,
                  std::shared_ptr<bam1_t> &read) {
-    if (matches !=
-        (queries[index].second.count(std::string(bam_get_qname(read))) == 1)) {
-      std::cerr << queries[index].first << " is " << (matches ? "" : "not ")
-                << "matching " << bam_get_qname(read) << " and that's wrong."
-                << std::endl;
-      correct = false;
-    }
+    correct &= checkMatch(index, matches, read);
   }
   bool isCorrect() { return correct; }
 
@@ -85,6 +157,32 @@ private:
   bool correct;
 };
 
+/*
+ * Evaluate a query directly, as is done while it is compiled in the
+ * background, and check the results are the same as the compiled code's.
+ */
+class Interpreter : public bamql::ReadIterator {
+public:
+  Interpreter(std::shared_ptr<bamql::AstNode> &node_, int index_)
+      : node(node_), correct(node_->isInterpretable()), index(index_) {}
+  bool wantChromosome(std::shared_ptr<bam_hdr_t> &header, uint32_t tid) {
+    return node->evaluateIndex(header.get(), tid);
+  }
+  void ingestHeader(std::shared_ptr<bam_hdr_t> &header) {}
+  void processRead(std::shared_ptr<bam_hdr_t> &header,
+                   std::shared_ptr<bam1_t> &read) {
+    bamql_read_context context = { 0, 0 };
+    correct &= checkMatch(
+        index, node->evaluate(header.get(), read.get(), &context), read);
+  }
+  bool isCorrect() { return correct; }
+
+private:
+  std::shared_ptr<bamql::AstNode> node;
+  bool correct;
+  int index;
+};
+
 int main(int argc, char *const *argv) {
   bool success = true;
   LLVMInitializeNativeTarget();
@@ -93,13 +191,14 @@ int main(int argc, char *const *argv) {
   std::unique_ptr<llvm::Module> module(
       new llvm::Module("bamql", llvm::getGlobalContext()));
   auto generator = std::make_shared<bamql::Generator>(module.get(), nullptr);
-  auto engine = bamql::createEngine(std::move(module));
+  auto engine = bamql::createEngine(std::move(module), false, false);
   if (!engine) {
     std::cerr << "Failed to initialise LLVM." << std::endl;
     return 1;
   }
 
-  std::vector<Checker> checkers;
+  std::vector<std::unique_ptr<Checker>> checkers;
+  std::vector<Interpreter> interpreters;
   for (int index = 0; index < queries.size(); index++) {
     auto ast = bamql::AstNode::parseWithLogging(queries[index].first,
                                                 bamql::getDefaultPredicates());
@@ -111,15 +210,20 @@ int main(int argc, char *const *argv) {
     }
     std::stringstream name;
     name << "test" << index;
-    checkers.push_back(
-        std::move(Checker(engine, generator, ast, name.str(), index)));
+    checkers.push_back(std::unique_ptr<Checker>(
+        new Checker(engine, generator, ast, name.str(), index)));
+    interpreters.push_back(Interpreter(ast, index));
   }
+  bamql::linkRuntime(generator->module());
   engine->finalizeObject();
 
   for (int index = 0; index < queries.size(); index++) {
-    checkers[index].prepareExecution();
-    bool test_success = checkers[index].processFile("test.sam", false, false) &&
-                        checkers[index].isCorrect();
+    checkers[index]->prepareExecution();
+    bool test_success =
+        checkers[index]->processFile("test.sam", false, false) &&
+        checkers[index]->isCorrect() &&
+        interpreters[index].processFile("test.sam", false, false) &&
+        interpreters[index].isCorrect();
     std::cerr << index << " " << (test_success ? "----" : "FAIL") << " "
               << queries[index].first << std::endl;
     success &= test_success;
@@ -14,8 +14,11 @@
  * credit be given to OICR scientists, as scientifically appropriate.
  */
 
+#include <iomanip>
+#include <sstream>
 #include <htslib/sam.h>
 #include "bamql.hpp"
+#include "runtime.h"
 
 namespace bamql {
 
@@ -33,15 +36,19 @@ public:
                                 llvm::Value *read,
                                 llvm::Value *header) {
     auto function = state.module()->getFunction("check_aux_str");
-    return state->CreateCall4(
+    return state->CreateCall2(
         function,
-        read,
-        state.createString(name),
-        llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               G1),
-        llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               G2));
+        state.auxTag(read, G1, G2),
+        state.createString(name));
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_aux_str(bamql_aux_get(read, G1, G2), name.c_str());
   }
+  std::string key() {
+    return std::string("aux_str(") + G1 + G2 + "," + name + ")";
+  }
+  unsigned int cost() { return 4; }
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('(');
 
@@ -75,15 +82,19 @@ public:
                                 llvm::Value *read,
                                 llvm::Value *header) {
     auto function = state.module()->getFunction("check_aux_str");
-    return state->CreateCall4(
+    return state->CreateCall2(
         function,
-        read,
-        state.createString(name),
-        llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               first),
-        llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               second));
+        state.auxTag(read, first, second),
+        state.createString(name));
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_aux_str(bamql_aux_get(read, first, second), name.c_str());
+  }
+  std::string key() {
+    return std::string("aux_str(") + first + second + "," + name + ")";
   }
+  unsigned int cost() { return 4; }
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('(');
 
@@ -134,16 +145,20 @@ public:
                                 llvm::Value *read,
                                 llvm::Value *header) {
     auto function = state.module()->getFunction("check_aux_char");
-    return state->CreateCall4(
+    return state->CreateCall2(
         function,
-        read,
-        llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               value),
-        llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               first),
+        state.auxTag(read, first, second),
         llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               second));
+                               value));
   }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_aux_char(bamql_aux_get(read, first, second), value);
+  }
+  std::string key() {
+    return std::string("aux_char(") + first + second + "," + value + ")";
+  }
+  unsigned int cost() { return 4; }
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('(');
 
@@ -184,16 +199,21 @@ public:
                                 llvm::Value *read,
                                 llvm::Value *header) {
     auto function = state.module()->getFunction("check_aux_int");
-    return state->CreateCall4(
+    return state->CreateCall2(
         function,
-        read,
+        state.auxTag(read, first, second),
         llvm::ConstantInt::get(llvm::Type::getInt32Ty(llvm::getGlobalContext()),
-                               value),
-        llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               first),
-        llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               second));
+                               value));
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_aux_int(bamql_aux_get(read, first, second), value);
   }
+  std::string key() {
+    return std::string("aux_int(") + first + second + "," +
+           std::to_string(value) + ")";
+  }
+  unsigned int cost() { return 4; }
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('(');
 
@@ -239,16 +259,23 @@ public:
                                 llvm::Value *read,
                                 llvm::Value *header) {
     auto function = state.module()->getFunction("check_aux_double");
-    return state->CreateCall4(
+    return state->CreateCall2(
         function,
-        read,
+        state.auxTag(read, first, second),
         llvm::ConstantFP::get(llvm::Type::getDoubleTy(llvm::getGlobalContext()),
-                              value),
-        llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               first),
-        llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               second));
+                              value));
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_aux_double(bamql_aux_get(read, first, second), value);
+  }
+  std::string key() {
+    std::ostringstream key;
+    key << std::setprecision(17) << "aux_dbl(" << first << second << ","
+        << value << ")";
+    return key.str();
   }
+  unsigned int cost() { return 4; }
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('(');
 
@@ -14,9 +14,14 @@
  * credit be given to OICR scientists, as scientifically appropriate.
  */
 
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
 #include <set>
+#include <strings.h>
 #include <htslib/sam.h>
 #include "bamql.hpp"
+#include "runtime.h"
 
 namespace bamql {
 
@@ -26,6 +31,84 @@ namespace bamql {
  */
 extern const std::set<std::set<std::string>> equivalence_sets;
 
+/**
+ * A sorted table of chromosome names, used to find the per-chromosome data of
+ * a predicate in the runtime. As for `chr`, names are compared without any
+ * `chr` prefix and ignoring case.
+ */
+class ChromosomeTable {
+public:
+  /**
+   * Convert a chromosome name into the form kept in the table.
+   */
+  static std::string normalise(const std::string &name) {
+    std::string result;
+    for (size_t it = strncasecmp("chr", name.c_str(), 3) == 0 ? 3 : 0;
+         it < name.length();
+         it++) {
+      result.push_back(tolower(name[it]));
+    }
+    return result;
+  }
+  /**
+   * Add a chromosome, which must already be normalised and come after all the
+   * others.
+   */
+  void add(const std::string &name) {
+    chromosomes.push_back(name);
+    offsets.push_back(names.length());
+    names.append(name);
+    names.push_back('\0');
+  }
+  uint32_t size() const { return offsets.size(); }
+  /**
+   * Find a chromosome in the header.
+   * @returns: the index of the chromosome, or -1 if it is not in the table.
+   */
+  int32_t find(bam_hdr_t *header, uint32_t tid) const {
+    if (tid >= header->n_targets) {
+      return -1;
+    }
+    auto name = normalise(header->target_name[tid]);
+    auto found = std::lower_bound(chromosomes.begin(), chromosomes.end(), name);
+    return found != chromosomes.end() && *found == name
+               ? found - chromosomes.begin()
+               : -1;
+  }
+  const char *nameData() const { return names.data(); }
+  const uint32_t *offsetData() const { return offsets.data(); }
+  /**
+   * Add the names, their offsets, and the count to the arguments of a runtime
+   * call.
+   */
+  void generate(GenerateState &state, std::vector<llvm::Value *> &args) {
+    args.push_back(state.createArray(llvm::ConstantDataArray::getString(
+        llvm::getGlobalContext(), names, false)));
+    args.push_back(state.createArray(llvm::ConstantDataArray::get(
+        llvm::getGlobalContext(), llvm::ArrayRef<uint32_t>(offsets))));
+    args.push_back(llvm::ConstantInt::get(
+        llvm::Type::getInt32Ty(llvm::getGlobalContext()), offsets.size()));
+  }
+  /**
+   * Generate a check that a chromosome is in the table, for an index function.
+   */
+  llvm::Value *generateIndex(GenerateState &state,
+                             llvm::Value *chromosome,
+                             llvm::Value *header) {
+    auto function = state.module()->getFunction("check_table_chromosome");
+    std::vector<llvm::Value *> args;
+    args.push_back(chromosome);
+    args.push_back(header);
+    generate(state, args);
+    return state->CreateCall(function, args);
+  }
+
+private:
+  std::vector<std::string> chromosomes;
+  std::string names;
+  std::vector<uint32_t> offsets;
+};
+
 /**
  * A predicate that checks of the chromosome name.
  */
@@ -45,6 +128,26 @@ public:
         mate ? llvm::ConstantInt::getTrue(llvm::getGlobalContext())
              : llvm::ConstantInt::getFalse(llvm::getGlobalContext()));
   }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_chromosome(read, header, name.c_str(), mate);
+  }
+  bool evaluateIndex(bam_hdr_t *header, uint32_t tid) {
+    return mate || check_chromosome_id(tid, header, name.c_str());
+  }
+  bool isVectorisable() { return true; }
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns) {
+    std::vector<llvm::Value *> extra;
+    extra.push_back(columns.header());
+    extra.push_back(state.createString(name));
+    extra.push_back(
+        mate ? llvm::ConstantInt::getTrue(llvm::getGlobalContext())
+             : llvm::ConstantInt::getFalse(llvm::getGlobalContext()));
+    return state->CreateICmpNE(
+        columns.load(state, "bamql_gather_chromosome", extra),
+        VectorColumns::splat(llvm::ConstantInt::get(
+            llvm::Type::getInt8Ty(llvm::getGlobalContext()), 0)));
+  }
   virtual llvm::Value *generateIndex(GenerateState &state,
                                      llvm::Value *chromosome,
                                      llvm::Value *header) {
@@ -57,6 +160,18 @@ public:
   }
 
   bool usesIndex() { return !mate; }
+  bool indexIsExact() { return !mate; }
+  std::string key() { return (mate ? "mate_chr(" : "chr(") + name + ")"; }
+  unsigned int cost() { return 2; }
+  bool regionTest(RegionMap &regions) {
+    // Every read on the chromosome overlaps all of it.
+    if (mate || name.find_first_of("*?") != std::string::npos) {
+      return false;
+    }
+    regions[ChromosomeTable::normalise(name)].push_back(
+        std::make_pair(0, INT32_MAX));
+    return true;
+  }
 
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('(');
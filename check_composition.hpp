@@ -0,0 +1,147 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#pragma once
+#include <iomanip>
+#include <sstream>
+#include <htslib/sam.h>
+#include "bamql.hpp"
+#include "runtime.h"
+
+namespace bamql {
+
+/**
+ * A predicate that checks the fraction of the bases, other than N, that are G
+ * or C.
+ */
+class GcNode : public DebuggableNode {
+public:
+  GcNode(double min_, double max_, ParseState &state)
+      : DebuggableNode(state), min(min_), max(max_) {}
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header) {
+    auto function = state.module()->getFunction("check_gc");
+    return state->CreateCall4(
+        function,
+        read,
+        state.readContext(),
+        llvm::ConstantFP::get(llvm::Type::getDoubleTy(llvm::getGlobalContext()),
+                              min),
+        llvm::ConstantFP::get(llvm::Type::getDoubleTy(llvm::getGlobalContext()),
+                              max));
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_gc(read, context, min, max);
+  }
+  std::string key() {
+    std::ostringstream key;
+    key << std::setprecision(17) << "gc(" << min << "," << max << ")";
+    return key.str();
+  }
+  unsigned int cost() { return 5; }
+
+  static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
+    state.parseCharInSpace('(');
+    auto min = state.parseDouble();
+    state.parseCharInSpace(',');
+    auto max = state.parseDouble();
+    if (max < min) {
+      throw ParseError(state.where(), "Maximum is less than minimum.");
+    }
+    state.parseCharInSpace(')');
+    return std::make_shared<GcNode>(min, max, state);
+  }
+
+private:
+  double min;
+  double max;
+};
+
+/**
+ * A predicate that checks that a read has at most some number of N bases.
+ */
+class NCountNode : public DebuggableNode {
+public:
+  NCountNode(uint32_t max_, ParseState &state)
+      : DebuggableNode(state), max(max_) {}
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header) {
+    auto function = state.module()->getFunction("check_n_count");
+    return state->CreateCall3(
+        function,
+        read,
+        state.readContext(),
+        llvm::ConstantInt::get(llvm::Type::getInt32Ty(llvm::getGlobalContext()),
+                               max));
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_n_count(read, context, max);
+  }
+  std::string key() { return "n_count(" + std::to_string(max) + ")"; }
+  unsigned int cost() { return 5; }
+
+  static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
+    state.parseCharInSpace('(');
+    auto max = state.parseInt();
+    state.parseCharInSpace(')');
+    return std::make_shared<NCountNode>(max, state);
+  }
+
+private:
+  uint32_t max;
+};
+
+/**
+ * A predicate that checks for a run of at least some length of the same base,
+ * other than N.
+ */
+class HomopolymerNode : public DebuggableNode {
+public:
+  HomopolymerNode(uint32_t length_, ParseState &state)
+      : DebuggableNode(state), length(length_) {}
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header) {
+    auto function = state.module()->getFunction("check_homopolymer");
+    return state->CreateCall3(
+        function,
+        read,
+        state.readContext(),
+        llvm::ConstantInt::get(llvm::Type::getInt32Ty(llvm::getGlobalContext()),
+                               length));
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_homopolymer(read, context, length);
+  }
+  std::string key() { return "homopolymer(" + std::to_string(length) + ")"; }
+  unsigned int cost() { return 5; }
+
+  static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
+    state.parseCharInSpace('(');
+    auto length = state.parseInt();
+    state.parseCharInSpace(')');
+    return std::make_shared<HomopolymerNode>(length, state);
+  }
+
+private:
+  uint32_t length;
+};
+}
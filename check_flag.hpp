@@ -14,11 +14,79 @@
  * credit be given to OICR scientists, as scientifically appropriate.
  */
 
+#pragma once
 #include <htslib/sam.h>
 #include "bamql.hpp"
+#include "runtime.h"
 
 namespace bamql {
 
+/**
+ * A check of several bits of the read's flag at once: the read matches if
+ * `((flag & mask) == value) != negated`. This is created by combining other
+ * flag checks; it is not available in the query language.
+ */
+class FlagMaskNode : public AstNode {
+public:
+  FlagMaskNode(uint16_t mask_, uint16_t value_, bool negated_)
+      : mask(mask_), value(value_), negated(negated_) {}
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header) {
+    auto function = state.module()->getFunction("check_flag_mask");
+    llvm::Value *result = state->CreateCall3(
+        function,
+        read,
+        llvm::ConstantInt::get(llvm::Type::getInt16Ty(llvm::getGlobalContext()),
+                               mask),
+        llvm::ConstantInt::get(llvm::Type::getInt16Ty(llvm::getGlobalContext()),
+                               value));
+    return negated ? state->CreateNot(result) : result;
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_flag_mask(read, mask, value) != negated;
+  }
+  bool isVectorisable() { return true; }
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns) {
+    auto flag = columns.load(state, "bamql_gather_flag");
+    auto mask_value = VectorColumns::splat(llvm::ConstantInt::get(
+        llvm::Type::getInt16Ty(llvm::getGlobalContext()), mask));
+    auto value_value = VectorColumns::splat(llvm::ConstantInt::get(
+        llvm::Type::getInt16Ty(llvm::getGlobalContext()), value));
+    auto masked = state->CreateAnd(flag, mask_value);
+    return negated ? state->CreateICmpNE(masked, value_value)
+                   : state->CreateICmpEQ(masked, value_value);
+  }
+  std::string key() {
+    return "flag_mask(" + std::to_string(mask) + "," + std::to_string(value) +
+           (negated ? ",not)" : ")");
+  }
+  unsigned int cost() { return 1; }
+  bool constantValue(bool &result) {
+    if (mask == 0) {
+      result = (value == 0) != negated;
+      return true;
+    }
+    return false;
+  }
+  bool flagTest(uint16_t &mask_, uint16_t &value_, bool &negated_) {
+    mask_ = mask;
+    value_ = value;
+    negated_ = negated;
+    return true;
+  }
+  std::shared_ptr<AstNode> negate() {
+    return std::make_shared<FlagMaskNode>(mask, value, !negated);
+  }
+  void writeDebug(GenerateState &state) {}
+
+private:
+  uint16_t mask;
+  uint16_t value;
+  bool negated;
+};
+
 /**
  * A predicate that checks of the read's flag.
  */
@@ -35,6 +103,29 @@ public:
         llvm::ConstantInt::get(llvm::Type::getInt16Ty(llvm::getGlobalContext()),
                                F));
   }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_flag(read, F);
+  }
+  bool isVectorisable() { return true; }
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns) {
+    auto mask = VectorColumns::splat(llvm::ConstantInt::get(
+        llvm::Type::getInt16Ty(llvm::getGlobalContext()), F));
+    return state->CreateICmpEQ(
+        state->CreateAnd(columns.load(state, "bamql_gather_flag"), mask),
+        mask);
+  }
+  std::string key() { return "flag(" + std::to_string(F) + ")"; }
+  unsigned int cost() { return 1; }
+  bool flagTest(uint16_t &mask, uint16_t &value, bool &negated) {
+    mask = F;
+    value = F;
+    negated = false;
+    return true;
+  }
+  std::shared_ptr<AstNode> negate() {
+    return std::make_shared<FlagMaskNode>(F, F, true);
+  }
 
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     static auto result = std::make_shared<CheckFlag<F>>(state);
@@ -15,7 +15,10 @@
  */
 
 #pragma once
+#include <algorithm>
+#include <cctype>
 #include "boolean_constant.hpp"
+#include "runtime.h"
 
 namespace bamql {
 /**
@@ -29,15 +32,35 @@ public:
                                 llvm::Value *read,
                                 llvm::Value *header) {
     auto function = state.module()->getFunction("check_nt");
-    return state->CreateCall4(
+    return state->CreateCall5(
         function,
         read,
+        state.readContext(),
         llvm::ConstantInt::get(llvm::Type::getInt32Ty(llvm::getGlobalContext()),
                                position),
         llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
                                nt),
         EXACT(llvm::getGlobalContext()));
   }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_nt(read, context, position, nt, isTrue<EXACT>());
+  }
+  std::string key() {
+    return "nt(" + std::to_string(position) + "," + std::to_string(nt) + "," +
+           (EXACT(llvm::getGlobalContext())->isOne() ? "exact" : "any") + ")";
+  }
+  unsigned int cost() { return 5; }
+  bool nucleotideTest(std::vector<std::pair<int32_t, unsigned char>> &sites,
+                      bool &exact) {
+    sites.push_back(std::make_pair(position, nt));
+    exact = isTrue<EXACT>();
+    return true;
+  }
+  bool positionRanges(bam_hdr_t *header, uint32_t tid, PositionRanges &ranges) {
+    ranges.push_back(std::make_pair(position, position));
+    return true;
+  }
 
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('(');
@@ -52,4 +75,192 @@ private:
   int32_t position;
   unsigned char nt;
 };
+
+/**
+ * A predicate that matches a read with any of several nucleotides. The sites
+ * are kept sorted by position, so the read's CIGAR string is walked once for
+ * all of them. This is created by `nt_any` or by combining `nt` checks.
+ */
+class NucleotideSetNode : public AstNode {
+public:
+  NucleotideSetNode(const std::vector<std::pair<int32_t, unsigned char>> &sites,
+                    bool exact_)
+      : exact(exact_) {
+    auto sorted = sites;
+    std::stable_sort(
+        sorted.begin(),
+        sorted.end(),
+        [](const std::pair<int32_t, unsigned char> &a,
+           const std::pair<int32_t, unsigned char> &b) {
+          return a.first < b.first;
+        });
+    for (auto it = sorted.begin(); it != sorted.end(); it++) {
+      positions.push_back(it->first);
+      nts.push_back(it->second);
+    }
+  }
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header) {
+    auto function = state.module()->getFunction("check_nt_any");
+    std::vector<llvm::Value *> args;
+    args.push_back(read);
+    args.push_back(state.readContext());
+    // LLVM only makes arrays of unsigned integers; the bits are the same.
+    args.push_back(state.createArray(llvm::ConstantDataArray::get(
+        llvm::getGlobalContext(),
+        llvm::ArrayRef<uint32_t>((const uint32_t *)positions.data(),
+                                 positions.size()))));
+    args.push_back(state.createArray(llvm::ConstantDataArray::get(
+        llvm::getGlobalContext(), llvm::ArrayRef<uint8_t>(nts))));
+    args.push_back(llvm::ConstantInt::get(
+        llvm::Type::getInt32Ty(llvm::getGlobalContext()), positions.size()));
+    args.push_back(llvm::ConstantInt::get(
+        llvm::Type::getInt1Ty(llvm::getGlobalContext()), exact));
+    return state->CreateCall(function, args);
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_nt_any(
+        read, context, positions.data(), nts.data(), positions.size(), exact);
+  }
+  std::string key() {
+    std::string result = "nt_any(";
+    for (size_t it = 0; it < positions.size(); it++) {
+      result += std::to_string(positions[it]) + "," + std::to_string(nts[it]) +
+                ",";
+    }
+    return result + (exact ? "exact" : "any") + ")";
+  }
+  unsigned int cost() { return 5; }
+  bool nucleotideTest(std::vector<std::pair<int32_t, unsigned char>> &sites,
+                      bool &exact_) {
+    for (size_t it = 0; it < positions.size(); it++) {
+      sites.push_back(std::make_pair(positions[it], nts[it]));
+    }
+    exact_ = exact;
+    return true;
+  }
+  bool positionRanges(bam_hdr_t *header, uint32_t tid, PositionRanges &ranges) {
+    for (auto it = positions.begin(); it != positions.end(); it++) {
+      ranges.push_back(std::make_pair(*it, *it));
+    }
+    normaliseRanges(ranges);
+    return true;
+  }
+  void writeDebug(GenerateState &state) {}
+
+  template <bool EXACT>
+  static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
+    std::vector<std::pair<int32_t, unsigned char>> sites;
+    state.parseCharInSpace('(');
+    while (true) {
+      auto position = state.parseInt();
+      state.parseCharInSpace(',');
+      auto nt = state.parseNucleotide();
+      sites.push_back(std::make_pair(position, nt));
+      state.parseSpace();
+      if (state.empty() || *state != ',') {
+        break;
+      }
+      state.next();
+      state.parseSpace();
+    }
+    state.parseCharInSpace(')');
+    return std::make_shared<NucleotideSetNode>(sites, EXACT);
+  }
+
+private:
+  std::vector<int32_t> positions;
+  std::vector<uint8_t> nts;
+  bool exact;
+};
+
+/**
+ * A predicate that matches a read whose sequence contains a motif, and,
+ * optionally, its reverse complement. The motif may have up to 64 IUPAC
+ * nucleotides. A base in the read that is itself ambiguous only matches if
+ * every base it could be is allowed.
+ */
+class MotifNode : public DebuggableNode {
+public:
+  MotifNode(const std::string &motif_,
+            const std::vector<unsigned char> &nts,
+            bool both_,
+            ParseState &state)
+      : DebuggableNode(state), motif(motif_), both(both_), masks(32, 0),
+        length(nts.size()) {
+    for (size_t it = 0; it < nts.size(); it++) {
+      addMask(0, it, nts[it]);
+      if (both) {
+        addMask(16, nts.size() - it - 1, complement(nts[it]));
+      }
+    }
+  }
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header) {
+    auto function = state.module()->getFunction("check_motif");
+    std::vector<llvm::Value *> args;
+    args.push_back(read);
+    args.push_back(state.createArray(llvm::ConstantDataArray::get(
+        llvm::getGlobalContext(), llvm::ArrayRef<uint64_t>(masks))));
+    args.push_back(llvm::ConstantInt::get(
+        llvm::Type::getInt32Ty(llvm::getGlobalContext()), length));
+    return state->CreateCall(function, args);
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_motif(read, masks.data(), length);
+  }
+  std::string key() {
+    return (both ? "motif_either(" : "motif(") + motif + ")";
+  }
+  unsigned int cost() { return 7; }
+
+  template <bool BOTH>
+  static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
+    state.parseCharInSpace('(');
+    auto start = state.where();
+    std::vector<unsigned char> nts;
+    while (!state.empty() && isalpha(*state)) {
+      auto nt = state.parseNucleotide();
+      if (nt == 0) {
+        throw ParseError(state.where() - 1, "Unknown nucleotide.");
+      }
+      nts.push_back(nt);
+    }
+    if (nts.empty() || nts.size() > 64) {
+      throw ParseError(start, "Expected a motif of 1 to 64 nucleotides.");
+    }
+    auto motif = state.strFrom(start);
+    state.parseCharInSpace(')');
+    return std::make_shared<MotifNode>(motif, nts, BOTH, state);
+  }
+
+private:
+  /**
+   * Swap A with T and C with G in a nucleotide bitmap.
+   */
+  static unsigned char complement(unsigned char nt) {
+    return ((nt & 1) << 3) | ((nt & 2) << 1) | ((nt & 4) >> 1) |
+           ((nt & 8) >> 3);
+  }
+  /**
+   * Allow every base in the read that is one of the nucleotides at a position
+   * of the motif.
+   */
+  void addMask(size_t offset, size_t position, unsigned char nt) {
+    for (unsigned int base = 1; base < 16; base++) {
+      if ((base & ~nt) == 0) {
+        masks[offset + base] |= 1ULL << position;
+      }
+    }
+  }
+
+  std::string motif;
+  bool both;
+  std::vector<uint64_t> masks;
+  uint32_t length;
+};
 }
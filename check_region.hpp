@@ -0,0 +1,201 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#pragma once
+#include <cstdlib>
+#include <htslib/kseq.h>
+#include <htslib/sam.h>
+#include "bamql.hpp"
+#include "check_chromosome.hpp"
+#include "runtime.h"
+
+namespace bamql {
+
+/**
+ * A predicate that matches reads overlapping any of a set of regions. The
+ * regions of each chromosome are merged and sorted, so a read is checked by
+ * bisection. This is created by `region` or by combining checks of
+ * chromosomes and positions.
+ */
+class RegionNode : public AstNode {
+public:
+  /**
+   * @param regions: the regions, normalised, which must not include the empty
+   * name.
+   * @param path: the file the regions were read from, if any.
+   */
+  RegionNode(const RegionMap &regions, const std::string &path_)
+      : path(path_) {
+    for (auto it = regions.begin(); it != regions.end(); it++) {
+      table.add(it->first);
+      starts.push_back(region_starts.size());
+      for (auto range = it->second.begin(); range != it->second.end();
+           range++) {
+        region_starts.push_back(range->first);
+        region_ends.push_back(range->second);
+      }
+    }
+    starts.push_back(region_starts.size());
+  }
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header) {
+    auto function = state.module()->getFunction("check_region");
+    std::vector<llvm::Value *> args;
+    args.push_back(header);
+    args.push_back(read);
+    args.push_back(state.readContext());
+    table.generate(state, args);
+    for (auto array : { &starts, &region_starts, &region_ends }) {
+      args.push_back(state.createArray(llvm::ConstantDataArray::get(
+          llvm::getGlobalContext(), llvm::ArrayRef<uint32_t>(*array))));
+    }
+    return state->CreateCall(function, args);
+  }
+  virtual llvm::Value *generateIndex(GenerateState &state,
+                                     llvm::Value *chromosome,
+                                     llvm::Value *header) {
+    return table.generateIndex(state, chromosome, header);
+  }
+  bool usesIndex() { return true; }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_region(header,
+                        read,
+                        context,
+                        table.nameData(),
+                        table.offsetData(),
+                        table.size(),
+                        starts.data(),
+                        region_starts.data(),
+                        region_ends.data());
+  }
+  bool evaluateIndex(bam_hdr_t *header, uint32_t tid) {
+    return table.find(header, tid) >= 0;
+  }
+  bool positionRanges(bam_hdr_t *header, uint32_t tid, PositionRanges &ranges) {
+    auto index = table.find(header, tid);
+    if (index >= 0) {
+      for (auto it = starts[index]; it < starts[index + 1]; it++) {
+        ranges.push_back(std::make_pair(region_starts[it], region_ends[it]));
+      }
+    }
+    return true;
+  }
+  bool regionTest(RegionMap &regions) {
+    regions = allRegions();
+    return true;
+  }
+  std::string key() {
+    if (!path.empty()) {
+      return "region(" + path + ")";
+    }
+    std::string result = "region(";
+    auto all = allRegions();
+    for (auto it = all.begin(); it != all.end(); it++) {
+      for (auto range = it->second.begin(); range != it->second.end();
+           range++) {
+        result += it->first + ":" + std::to_string(range->first) + "-" +
+                  std::to_string(range->second) + ",";
+      }
+    }
+    return result + ")";
+  }
+  unsigned int cost() { return 3; }
+  void writeDebug(GenerateState &state) {}
+
+  static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
+    state.parseCharInSpace('(');
+    auto start = state.where();
+    auto path = state.parsePath();
+    auto handle = hts_open(path.c_str(), "r");
+    if (handle == nullptr) {
+      throw ParseError(start, "Cannot open region file `" + path + "'.");
+    }
+    std::shared_ptr<htsFile> file(handle, hts_close);
+
+    RegionMap regions;
+    std::string error;
+    kstring_t line = { 0, 0, nullptr };
+    for (int line_number = 1;
+         error.empty() && hts_getline(file.get(), KS_SEP_LINE, &line) >= 0;
+         line_number++) {
+      std::string text(line.s, line.l);
+      if (text.empty() || text[0] == '#' || text.compare(0, 5, "track") == 0 ||
+          text.compare(0, 7, "browser") == 0) {
+        continue;
+      }
+      // Only the chromosome, start, and end columns are needed.
+      auto first_tab = text.find('\t');
+      auto second_tab = first_tab == std::string::npos
+                            ? std::string::npos
+                            : text.find('\t', first_tab + 1);
+      char *end_ptr = nullptr;
+      long region_start = -1;
+      long region_end = -1;
+      if (first_tab > 0 && second_tab != std::string::npos) {
+        region_start = strtol(text.c_str() + first_tab + 1, &end_ptr, 10);
+        if (*end_ptr == '\t') {
+          region_end = strtol(end_ptr + 1, &end_ptr, 10);
+        }
+      }
+      if (region_start < 0 || region_end < region_start ||
+          region_end > INT32_MAX || (*end_ptr != '\0' && *end_ptr != '\t')) {
+        error = path + ":" + std::to_string(line_number) +
+                ": Expected chromosome, start, and end.";
+        break;
+      }
+      // BED intervals start at 0 and exclude the end; positions in queries
+      // start at 1 and include the end.
+      if (region_end > region_start) {
+        regions[ChromosomeTable::normalise(text.substr(0, first_tab))]
+            .push_back(std::make_pair(region_start + 1, region_end));
+      }
+    }
+    free(line.s);
+    if (!error.empty()) {
+      throw ParseError(start, error);
+    }
+    for (auto it = regions.begin(); it != regions.end(); it++) {
+      normaliseRanges(it->second);
+    }
+
+    state.parseCharInSpace(')');
+    return std::make_shared<RegionNode>(regions, path);
+  }
+
+private:
+  /**
+   * Rebuild the regions from the table.
+   */
+  RegionMap allRegions() {
+    RegionMap result;
+    for (uint32_t index = 0; index < table.size(); index++) {
+      auto &ranges = result[table.nameData() + table.offsetData()[index]];
+      for (auto it = starts[index]; it < starts[index + 1]; it++) {
+        ranges.push_back(std::make_pair(region_starts[it], region_ends[it]));
+      }
+    }
+    return result;
+  }
+
+  std::string path;
+  ChromosomeTable table;
+  std::vector<uint32_t> starts;
+  std::vector<uint32_t> region_starts;
+  std::vector<uint32_t> region_ends;
+};
+}
@@ -0,0 +1,370 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#pragma once
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <htslib/kseq.h>
+#include <htslib/sam.h>
+#include "bamql.hpp"
+#include "runtime.h"
+
+namespace bamql {
+
+/**
+ * A set of strings, such as read names, kept as an open addressing hash table
+ * so that it can be embedded in a query and checked by the runtime without
+ * any allocation. Each slot of the table holds the full hash of a string and
+ * its offset into a block of strings, so most misses never touch the strings.
+ */
+class StringSet {
+public:
+  StringSet() : table(2 * 16, UINT32_MAX), count(0) {}
+  /**
+   * Add a string to the set.
+   * @returns: false if the set is too large.
+   */
+  bool add(const std::string &value) {
+    if (contains(value.c_str())) {
+      return true;
+    }
+    if (strings.length() + value.length() >= UINT32_MAX) {
+      return false;
+    }
+    // Keep the table at most three quarters full so that probes stay short.
+    if ((count + 1) * 4 > capacity() * 3) {
+      std::vector<uint32_t> old_table(4 * capacity(), UINT32_MAX);
+      old_table.swap(table);
+      for (size_t it = 0; it < old_table.size(); it += 2) {
+        if (old_table[it + 1] != UINT32_MAX) {
+          insert(old_table[it], old_table[it + 1]);
+        }
+      }
+    }
+    insert(bamql_string_hash(value.c_str()), strings.length());
+    strings.append(value);
+    strings.push_back('\0');
+    count++;
+    return true;
+  }
+  bool contains(const char *value) const {
+    return check_string_set(value, strings.data(), table.data(), mask());
+  }
+  size_t size() const { return count; }
+  /**
+   * Add the strings, the table, and the mask to the arguments of a runtime
+   * call.
+   */
+  void generate(GenerateState &state, std::vector<llvm::Value *> &args) {
+    args.push_back(state.createArray(llvm::ConstantDataArray::getString(
+        llvm::getGlobalContext(), strings, false)));
+    args.push_back(state.createArray(llvm::ConstantDataArray::get(
+        llvm::getGlobalContext(), llvm::ArrayRef<uint32_t>(table))));
+    args.push_back(llvm::ConstantInt::get(
+        llvm::Type::getInt32Ty(llvm::getGlobalContext()), mask()));
+  }
+  const char *stringData() const { return strings.data(); }
+  const uint32_t *tableData() const { return table.data(); }
+  uint32_t mask() const { return capacity() - 1; }
+
+  /**
+   * Parse a file name and read the first word of every line of that file into
+   * a set.
+   */
+  static StringSet parse(ParseState &state) throw(ParseError) {
+    auto start = state.where();
+    auto path = state.parsePath();
+    auto handle = hts_open(path.c_str(), "r");
+    if (handle == nullptr) {
+      throw ParseError(start, "Cannot open file `" + path + "'.");
+    }
+    std::shared_ptr<htsFile> file(handle, hts_close);
+
+    StringSet result;
+    result.path = path;
+    bool too_large = false;
+    kstring_t line = { 0, 0, nullptr };
+    while (!too_large && hts_getline(file.get(), KS_SEP_LINE, &line) >= 0) {
+      size_t length = 0;
+      while (length < line.l && !isspace(line.s[length])) {
+        length++;
+      }
+      if (length > 0) {
+        too_large = !result.add(std::string(line.s, length));
+      }
+    }
+    free(line.s);
+    if (too_large) {
+      throw ParseError(start, "Too many strings in `" + path + "'.");
+    }
+    return result;
+  }
+  const std::string &source() const { return path; }
+
+private:
+  uint32_t capacity() const { return table.size() / 2; }
+  void insert(uint32_t hash, uint32_t offset) {
+    auto index = hash & mask();
+    while (table[2 * index + 1] != UINT32_MAX) {
+      index = (index + 1) & mask();
+    }
+    table[2 * index] = hash;
+    table[2 * index + 1] = offset;
+  }
+
+  std::string path;
+  std::string strings;
+  std::vector<uint32_t> table;
+  size_t count;
+};
+
+/**
+ * A set of strings kept only as 64-bit fingerprints, in an open addressing
+ * hash table. This uses far less memory than a `StringSet` for large sets of
+ * long strings, at the price of a vanishingly small chance of a false match.
+ */
+class FingerprintSet {
+public:
+  FingerprintSet() : table(16, 0), count(0) {}
+  /**
+   * Add a string to the set.
+   * @returns: false if the set is too large.
+   */
+  bool add(const char *value) {
+    if ((count + 1) * 4 > table.size() * 3) {
+      if (table.size() > UINT32_MAX / 2) {
+        return false;
+      }
+      std::vector<uint64_t> old_table(table.size() * 2, 0);
+      old_table.swap(table);
+      for (auto it = old_table.begin(); it != old_table.end(); it++) {
+        if (*it != 0) {
+          insert(*it);
+        }
+      }
+    }
+    if (insert(bamql_fingerprint(value))) {
+      count++;
+    }
+    return true;
+  }
+  size_t size() const { return count; }
+  /**
+   * Add the table and the mask to the arguments of a runtime call.
+   */
+  void generate(GenerateState &state, std::vector<llvm::Value *> &args) {
+    args.push_back(state.createArray(llvm::ConstantDataArray::get(
+        llvm::getGlobalContext(), llvm::ArrayRef<uint64_t>(table))));
+    args.push_back(llvm::ConstantInt::get(
+        llvm::Type::getInt32Ty(llvm::getGlobalContext()), mask()));
+  }
+  const uint64_t *tableData() const { return table.data(); }
+  uint32_t mask() const { return table.size() - 1; }
+
+private:
+  /**
+   * Put a fingerprint in the table.
+   * @returns: false if it was already present.
+   */
+  bool insert(uint64_t fingerprint) {
+    auto index = fingerprint & mask();
+    while (table[index] != 0) {
+      if (table[index] == fingerprint) {
+        return false;
+      }
+      index = (index + 1) & mask();
+    }
+    table[index] = fingerprint;
+    return true;
+  }
+
+  std::vector<uint64_t> table;
+  size_t count;
+};
+
+/**
+ * A predicate that checks if the read name is in a set.
+ */
+class NameSetNode : public DebuggableNode {
+public:
+  NameSetNode(StringSet &&set_, ParseState &state)
+      : DebuggableNode(state), set(std::move(set_)) {}
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header) {
+    auto function = state.module()->getFunction("check_name_in");
+    std::vector<llvm::Value *> args;
+    args.push_back(read);
+    set.generate(state, args);
+    return state->CreateCall(function, args);
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_name_in(read, set.stringData(), set.tableData(), set.mask());
+  }
+  std::string key() { return "name_in(" + set.source() + ")"; }
+  unsigned int cost() { return 5; }
+  static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
+    state.parseCharInSpace('(');
+    auto set = StringSet::parse(state);
+    state.parseCharInSpace(')');
+    return std::make_shared<NameSetNode>(std::move(set), state);
+  }
+
+private:
+  StringSet set;
+};
+
+/**
+ * A predicate that checks if a string in the BAM auxiliary data is in a set.
+ */
+class AuxSetNode : public DebuggableNode {
+public:
+  AuxSetNode(char first_, char second_, StringSet &&set_, ParseState &state)
+      : DebuggableNode(state), first(first_), second(second_),
+        set(std::move(set_)) {}
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header) {
+    auto function = state.module()->getFunction("check_aux_in");
+    std::vector<llvm::Value *> args;
+    args.push_back(state.auxTag(read, first, second));
+    set.generate(state, args);
+    return state->CreateCall(function, args);
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_aux_in(bamql_aux_get(read, first, second),
+                        set.stringData(),
+                        set.tableData(),
+                        set.mask());
+  }
+  std::string key() {
+    return std::string("aux_in(") + first + second + "," + set.source() + ")";
+  }
+  unsigned int cost() { return 5; }
+  static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
+    state.parseCharInSpace('(');
+
+    auto first = *state;
+    state.next();
+    if (!isalnum(first)) {
+      throw ParseError(state.where(),
+                       "Expected alpha numeric identifier string.");
+    }
+    auto second = *state;
+    state.next();
+    if (!isalnum(second)) {
+      throw ParseError(state.where(),
+                       "Expected alpha numeric identifier string.");
+    }
+
+    state.parseCharInSpace(',');
+    auto set = StringSet::parse(state);
+    state.parseCharInSpace(')');
+
+    return std::make_shared<AuxSetNode>(first, second, std::move(set), state);
+  }
+
+private:
+  char first;
+  char second;
+  StringSet set;
+};
+
+/**
+ * A predicate that checks if the read name is the name of any read in another
+ * file, optionally only those matching a query. The other file is read once,
+ * when the query is parsed, and the names are kept as fingerprints.
+ */
+class NameJoinNode : public DebuggableNode {
+public:
+  NameJoinNode(FingerprintSet &&set_,
+               const std::string &key_,
+               ParseState &state)
+      : DebuggableNode(state), set(std::move(set_)), join_key(key_) {}
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header) {
+    auto function = state.module()->getFunction("check_name_fingerprint");
+    std::vector<llvm::Value *> args;
+    args.push_back(read);
+    set.generate(state, args);
+    return state->CreateCall(function, args);
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_name_fingerprint(read, set.tableData(), set.mask());
+  }
+  std::string key() { return join_key; }
+  unsigned int cost() { return 5; }
+  static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
+    state.parseCharInSpace('(');
+    auto start = state.where();
+    auto path = state.parsePath();
+    std::string key = "name_in_bam(" + path;
+    std::shared_ptr<AstNode> filter;
+    state.parseSpace();
+    if (!state.empty() && *state == ',') {
+      state.next();
+      auto filter_start = state.where();
+      filter = AstNode::parse(state, getDefaultPredicates());
+      simplify(filter);
+      if (!filter->isInterpretable()) {
+        throw ParseError(filter_start,
+                         "Query cannot be used to select reads from `" +
+                             path + "'.");
+      }
+      key += "," + filter->key();
+    }
+    state.parseCharInSpace(')');
+
+    auto handle = hts_open(path.c_str(), "r");
+    if (handle == nullptr) {
+      throw ParseError(start, "Cannot open file `" + path + "'.");
+    }
+    std::shared_ptr<htsFile> file(handle, hts_close);
+    std::shared_ptr<bam_hdr_t> header(sam_hdr_read(file.get()),
+                                      bam_hdr_destroy);
+    if (!header) {
+      throw ParseError(start, "Cannot read header of `" + path + "'.");
+    }
+    std::shared_ptr<bam1_t> read(bam_init1(), bam_destroy1);
+    FingerprintSet set;
+    bool too_large = false;
+    int status = 0;
+    while (!too_large &&
+           (status = sam_read1(file.get(), header.get(), read.get())) >= 0) {
+      bamql_read_context context = { 0, 0 };
+      if (!filter || filter->evaluate(header.get(), read.get(), &context)) {
+        too_large = !set.add(bam_get_qname(read.get()));
+      }
+    }
+    if (too_large) {
+      throw ParseError(start, "Too many reads in `" + path + "'.");
+    }
+    if (status < -1) {
+      throw ParseError(start, "Error reading `" + path + "'.");
+    }
+    return std::make_shared<NameJoinNode>(std::move(set), key + ")", state);
+  }
+
+private:
+  FingerprintSet set;
+  std::string join_key;
+};
+}
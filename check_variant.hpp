@@ -0,0 +1,209 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <htslib/kseq.h>
+#include <htslib/sam.h>
+#include "bamql.hpp"
+#include "check_chromosome.hpp"
+#include "runtime.h"
+
+namespace bamql {
+
+/**
+ * Convert a base from a VCF file into a BAM-compatible nucleotide bitmap, or
+ * zero if it isn't a single, known base.
+ */
+static unsigned char vcfBase(const std::string &base) {
+  if (base.length() != 1) {
+    return 0;
+  }
+  switch (base[0]) {
+  case 'A':
+  case 'a':
+    return 1;
+  case 'C':
+  case 'c':
+    return 2;
+  case 'G':
+  case 'g':
+    return 4;
+  case 'T':
+  case 't':
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * A predicate that matches reads carrying the alternate allele of any of the
+ * single nucleotide variants in a VCF file. The sites are kept sorted by
+ * chromosome and position, so only those under a read are checked.
+ */
+class AltAlleleNode : public DebuggableNode {
+public:
+  typedef std::map<std::string, std::vector<std::pair<int32_t, unsigned char>>>
+      SiteMap;
+  AltAlleleNode(const std::string &path_, SiteMap &sites, ParseState &state)
+      : DebuggableNode(state), path(path_) {
+    for (auto it = sites.begin(); it != sites.end(); it++) {
+      std::sort(it->second.begin(), it->second.end());
+      table.add(it->first);
+      starts.push_back(positions.size());
+      for (auto site = it->second.begin(); site != it->second.end(); site++) {
+        positions.push_back(site->first);
+        nts.push_back(site->second);
+      }
+    }
+    starts.push_back(positions.size());
+  }
+  virtual llvm::Value *generate(GenerateState &state,
+                                llvm::Value *read,
+                                llvm::Value *header) {
+    auto function = state.module()->getFunction("check_alt_allele");
+    std::vector<llvm::Value *> args;
+    args.push_back(header);
+    args.push_back(read);
+    args.push_back(state.readContext());
+    table.generate(state, args);
+    args.push_back(state.createArray(llvm::ConstantDataArray::get(
+        llvm::getGlobalContext(), llvm::ArrayRef<uint32_t>(starts))));
+    // LLVM only makes arrays of unsigned integers; the bits are the same.
+    args.push_back(state.createArray(llvm::ConstantDataArray::get(
+        llvm::getGlobalContext(),
+        llvm::ArrayRef<uint32_t>((const uint32_t *)positions.data(),
+                                 positions.size()))));
+    args.push_back(state.createArray(llvm::ConstantDataArray::get(
+        llvm::getGlobalContext(), llvm::ArrayRef<uint8_t>(nts))));
+    return state->CreateCall(function, args);
+  }
+  virtual llvm::Value *generateIndex(GenerateState &state,
+                                     llvm::Value *chromosome,
+                                     llvm::Value *header) {
+    return table.generateIndex(state, chromosome, header);
+  }
+  bool usesIndex() { return true; }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_alt_allele(header,
+                            read,
+                            context,
+                            table.nameData(),
+                            table.offsetData(),
+                            table.size(),
+                            starts.data(),
+                            positions.data(),
+                            nts.data());
+  }
+  bool evaluateIndex(bam_hdr_t *header, uint32_t tid) {
+    return table.find(header, tid) >= 0;
+  }
+  bool positionRanges(bam_hdr_t *header, uint32_t tid, PositionRanges &ranges) {
+    auto index = table.find(header, tid);
+    if (index >= 0) {
+      for (auto it = starts[index]; it < starts[index + 1]; it++) {
+        ranges.push_back(std::make_pair(positions[it], positions[it]));
+      }
+      normaliseRanges(ranges);
+    }
+    return true;
+  }
+  std::string key() { return "alt_allele(" + path + ")"; }
+  unsigned int cost() { return 8; }
+
+  static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
+    state.parseCharInSpace('(');
+    auto start = state.where();
+    auto path = state.parsePath();
+    auto handle = hts_open(path.c_str(), "r");
+    if (handle == nullptr) {
+      throw ParseError(start, "Cannot open variant file `" + path + "'.");
+    }
+    std::shared_ptr<htsFile> file(handle, hts_close);
+
+    SiteMap sites;
+    std::string error;
+    kstring_t line = { 0, 0, nullptr };
+    for (int line_number = 1;
+         error.empty() && hts_getline(file.get(), KS_SEP_LINE, &line) >= 0;
+         line_number++) {
+      if (line.l == 0 || line.s[0] == '#') {
+        continue;
+      }
+      // Only CHROM, POS, ID, REF, and ALT are needed.
+      std::string text(line.s, line.l);
+      std::vector<std::string> fields;
+      size_t field_start = 0;
+      while (fields.size() < 5) {
+        auto tab = text.find('\t', field_start);
+        fields.push_back(text.substr(field_start, tab - field_start));
+        if (tab == std::string::npos) {
+          break;
+        }
+        field_start = tab + 1;
+      }
+      char *end = nullptr;
+      long position =
+          fields.size() < 5 ? 0 : strtol(fields[1].c_str(), &end, 10);
+      if (position < 1 || position > INT32_MAX || *end != '\0') {
+        error = path + ":" + std::to_string(line_number) +
+                ": Expected chromosome, position, ID, reference, and "
+                "alternate alleles.";
+        break;
+      }
+      // Only single nucleotide variants can be checked.
+      if (vcfBase(fields[3]) == 0) {
+        continue;
+      }
+      auto chromosome = ChromosomeTable::normalise(fields[0]);
+      size_t allele_start = 0;
+      while (true) {
+        auto comma = fields[4].find(',', allele_start);
+        auto nt =
+            vcfBase(fields[4].substr(allele_start, comma - allele_start));
+        if (nt != 0) {
+          sites[chromosome].push_back(std::make_pair(position, nt));
+        }
+        if (comma == std::string::npos) {
+          break;
+        }
+        allele_start = comma + 1;
+      }
+    }
+    free(line.s);
+    if (!error.empty()) {
+      throw ParseError(start, error);
+    }
+    if (sites.empty()) {
+      throw ParseError(start,
+                       "No single nucleotide variants in `" + path + "'.");
+    }
+
+    state.parseCharInSpace(')');
+    return std::make_shared<AltAlleleNode>(path, sites, state);
+  }
+
+private:
+  std::string path;
+  ChromosomeTable table;
+  std::vector<uint32_t> starts;
+  std::vector<int32_t> positions;
+  std::vector<uint8_t> nts;
+};
+}
@@ -17,10 +17,30 @@
 #include <cstdio>
 #include <iostream>
 #include <sstream>
+#include <llvm/Support/TargetSelect.h>
 #include "bamql-jit.hpp"
+#include "runtime.h"
+
+/**
+ * The number of reads to read before processing them.
+ */
+#define BATCH_SIZE 256
+/**
+ * The smallest gap between ranges of positions worth seeking over.
+ */
+#define COALESCE_DISTANCE 65536
 
 bamql::ReadIterator::ReadIterator() {}
 
+void bamql::ReadIterator::processBatch(
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads,
+    size_t count) {
+  for (size_t it = 0; it < count; it++) {
+    processRead(header, reads[it]);
+  }
+}
+
 static bool checkHtsError(int result) {
   if (result == -1) {
     /* No error. */
@@ -37,9 +57,32 @@ static bool checkHtsError(int result) {
   return false;
 }
 
+/**
+ * Merge ranges of positions that are close enough that seeking between them
+ * would save little, since the index can't skip less than a compressed block.
+ */
+static void coalesceRanges(bamql::PositionRanges &ranges) {
+  size_t output = 0;
+  for (size_t it = 0; it < ranges.size(); it++) {
+    if (output > 0 &&
+        ranges[it].first - ranges[output - 1].second <= COALESCE_DISTANCE) {
+      ranges[output - 1].second = ranges[it].second;
+    } else {
+      ranges[output++] = ranges[it];
+    }
+  }
+  ranges.resize(output);
+}
+
+bool bamql::ReadIterator::wantPositions(std::shared_ptr<bam_hdr_t> &header,
+                                        uint32_t tid,
+                                        PositionRanges &ranges) {
+  return false;
+}
 bool bamql::ReadIterator::wantAll(std::shared_ptr<bam_hdr_t> &header) {
   for (auto tid = 0; tid < header->n_targets; tid++) {
-    if (!wantChromosome(header, tid)) {
+    PositionRanges ranges;
+    if (!wantChromosome(header, tid) || wantPositions(header, tid, ranges)) {
       return false;
     }
   }
@@ -64,59 +107,292 @@ bool bamql::ReadIterator::processFile(const char *file_name,
       ignore_index ? nullptr : hts_idx_load(file_name, HTS_FMT_BAI),
       hts_idx_destroy);
 
+  std::vector<std::shared_ptr<bam1_t>> reads;
+  for (auto it = 0; it < BATCH_SIZE; it++) {
+    reads.push_back(std::shared_ptr<bam1_t>(bam_init1(), bam_destroy1));
+  }
+  size_t count = 0;
+
   if (index && !wantAll(header)) {
-    std::shared_ptr<bam1_t> read(bam_init1(), bam_destroy1);
     // Rummage through all the chromosomes in the header...
     for (auto tid = 0; tid < header->n_targets; tid++) {
       if (!wantChromosome(header, tid)) {
         continue;
       }
-      // ...and use the index to seek through chomosome of interest.
-      std::shared_ptr<hts_itr_t> itr(
-          bam_itr_queryi(index.get(), tid, 0, INT_MAX), hts_itr_destroy);
-      int result;
-      while ((result = bam_itr_next(input.get(), itr.get(), read.get())) >= 0) {
-        processRead(header, read);
+      PositionRanges ranges;
+      if (wantPositions(header, tid, ranges)) {
+        coalesceRanges(ranges);
+      } else {
+        ranges.push_back(std::make_pair(1, INT_MAX));
       }
-      if (!checkHtsError(result)) {
-        return false;
+      // ...and use the index to seek through the parts of the chomosome of
+      // interest. The index takes 0-based, half-open intervals. A read that
+      // overlaps several ranges is returned for each, so skip any read that
+      // starts before the end of the previous range; it has been seen.
+      int32_t seen_end = 0;
+      for (auto range = ranges.begin(); range != ranges.end(); range++) {
+        std::shared_ptr<hts_itr_t> itr(
+            bam_itr_queryi(index.get(), tid, range->first - 1, range->second),
+            hts_itr_destroy);
+        int result;
+        while ((result = bam_itr_next(
+                    input.get(), itr.get(), reads[count].get())) >= 0) {
+          if (reads[count]->core.pos < seen_end) {
+            continue;
+          }
+          if (++count == BATCH_SIZE) {
+            processBatch(header, reads, count);
+            count = 0;
+          }
+        }
+        if (!checkHtsError(result)) {
+          return false;
+        }
+        seen_end = range->second;
+      }
+      if (count > 0) {
+        processBatch(header, reads, count);
+        count = 0;
       }
     }
     return true;
   }
 
   // Cycle through all the reads when an index is unavailable.
-  std::shared_ptr<bam1_t> read(bam_init1(), bam_destroy1);
   int result;
-  while ((result = sam_read1(input.get(), header.get(), read.get())) >= 0) {
-    processRead(header, read);
+  while ((result = sam_read1(input.get(), header.get(), reads[count].get())) >=
+         0) {
+    if (++count == BATCH_SIZE) {
+      processBatch(header, reads, count);
+      count = 0;
+    }
+  }
+  if (count > 0) {
+    processBatch(header, reads, count);
   }
   return checkHtsError(result);
 }
 
+/**
+ * Everything the compiler thread uses. Each step checks whether the iterator
+ * has been freed in the mean time, so an unneeded compile stops early.
+ */
+struct bamql::CheckIterator::Compilation {
+  std::unique_ptr<llvm::Module> module;
+  bool portable = false;
+  bool cache = true;
+  std::shared_ptr<Generator> generator;
+  std::shared_ptr<llvm::ExecutionEngine> engine;
+  std::atomic<bool> done{ false };
+  std::atomic<bool> cancelled{ false };
+
+  bool run() {
+    if (!engine) {
+      LLVMInitializeNativeTarget();
+      llvm::InitializeNativeTargetAsmParser();
+      llvm::InitializeNativeTargetAsmPrinter();
+      if (cancelled) {
+        return false;
+      }
+      engine = createEngine(std::move(module), portable, cache);
+      if (!engine) {
+        return false;
+      }
+    }
+    if (cancelled) {
+      return false;
+    }
+    linkRuntime(generator->module());
+    if (cancelled) {
+      return false;
+    }
+    engine->finalizeObject();
+    return true;
+  }
+};
+
 bamql::CheckIterator::CheckIterator(std::shared_ptr<llvm::ExecutionEngine> &e,
-                                    std::shared_ptr<Generator> &generator,
-                                    std::shared_ptr<AstNode> &node,
-                                    std::string name)
-    : engine(e), filter_func(node->createFilterFunction(generator, name)) {
+                                    std::shared_ptr<Generator> &generator_,
+                                    std::shared_ptr<AstNode> &node_,
+                                    std::string name_)
+    : engine(e), generator(generator_), node(node_), name(name_),
+      compilation(std::make_shared<Compilation>()) {
+  compilation->generator = generator;
+  compilation->engine = engine;
+  createFunctions(generator);
+}
+
+bamql::CheckIterator::CheckIterator(std::unique_ptr<llvm::Module> module,
+                                    std::shared_ptr<Generator> &generator_,
+                                    std::shared_ptr<AstNode> &node_,
+                                    std::string name_,
+                                    bool portable,
+                                    bool cache)
+    : generator(generator_), node(node_), name(name_),
+      compilation(std::make_shared<Compilation>()) {
+  compilation->module = std::move(module);
+  compilation->portable = portable;
+  compilation->cache = cache;
+  compilation->generator = generator;
+  createFunctions(generator);
+}
+
+void bamql::CheckIterator::createFunctions(
+    std::shared_ptr<Generator> &generator) {
   // Compile the query into native functions. We must hold a reference to the
   // execution engine as long as we intend for these pointers to be valid.
+  filter_func = node->createFilterFunction(generator, name);
   std::stringstream index_function_name;
   index_function_name << name << "_index";
   index_func = node->createIndexFunction(generator, index_function_name.str());
+  std::stringstream batch_function_name;
+  batch_function_name << name << "_batch";
+  batch_func = node->createBatchFunction(generator, batch_function_name.str());
 }
 
+bamql::CheckIterator::~CheckIterator() {
+  // If the reads were finished before the compiler, the native code will
+  // never be used, so stop at the next step. The compiler is using the engine,
+  // so it must still finish before it is freed.
+  if (compiler.joinable()) {
+    compilation->cancelled = true;
+    compiler.join();
+  }
+}
+
+bool bamql::CheckIterator::compileInBackground() {
+  if (!node->isInterpretable()) {
+    if (!compilation->run()) {
+      return false;
+    }
+    engine = compilation->engine;
+    compilation.reset();
+    return true;
+  }
+  interpreting = true;
+  // Nothing else may use LLVM until the compiler is done: the interpreter
+  // calls the runtime library directly and the native functions are only
+  // looked up after the thread has been joined. If the engine cannot be
+  // created, the query is interpreted to the end.
+  auto current = compilation;
+  compiler = std::thread([current]() {
+    if (current->run()) {
+      current->done = true;
+    }
+  });
+  return true;
+}
+
+bool bamql::CheckIterator::useInterpreter() {
+  if (!interpreting) {
+    return false;
+  }
+  if (!compilation->done) {
+    return true;
+  }
+  compiler.join();
+  engine = compilation->engine;
+  compilation.reset();
+  interpreting = false;
+  prepareExecution();
+  return false;
+}
+
+void bamql::CheckIterator::adaptAfter(size_t reads,
+                                      bool portable,
+                                      bool cache) {
+  adapt_after = reads;
+  adapt_portable = portable;
+  adapt_cache = cache;
+}
+
+void bamql::CheckIterator::countReads(size_t count) {
+  reads_seen += count;
+  if (adapt_after == 0 || reads_seen < adapt_after) {
+    return;
+  }
+  adapt_after = 0;
+
+  // Reorder the query based on the profile and compile it again, without
+  // counting this time. If anything goes wrong, the old code is still correct.
+  node->optimise(generator->profile());
+  std::unique_ptr<llvm::Module> module(
+      new llvm::Module("bamql", llvm::getGlobalContext()));
+  auto new_generator = std::make_shared<Generator>(module.get(), nullptr);
+  auto new_engine =
+      createEngine(std::move(module), adapt_portable, adapt_cache);
+  if (!new_engine) {
+    return;
+  }
+  createFunctions(new_generator);
+  linkRuntime(new_generator->module());
+  new_engine->finalizeObject();
+
+  // No generated code is running between reads, so the functions can be
+  // swapped and the old code released.
+  engine = new_engine;
+  generator = new_generator;
+  prepareExecution();
+}
+
+bamql::CheckIterator::CheckIterator(std::shared_ptr<void> &library_,
+                                    FilterFunction filter_,
+                                    IndexFunction index_,
+                                    BatchFunction batch_)
+    : filter(filter_), index(index_), batch(batch_), filter_func(nullptr),
+      index_func(nullptr), batch_func(nullptr), library(library_) {}
+
 void bamql::CheckIterator::prepareExecution() {
-  filter = getNativeFunction<FilterFunction>(engine, filter_func);
-  index = getNativeFunction<IndexFunction>(engine, index_func);
+  if (!interpreting && engine) {
+    filter = getNativeFunction<FilterFunction>(engine, filter_func);
+    index = getNativeFunction<IndexFunction>(engine, index_func);
+    batch = getNativeFunction<BatchFunction>(engine, batch_func);
+  }
+}
+
+bool bamql::CheckIterator::wantPositions(std::shared_ptr<bam_hdr_t> &header,
+                                         uint32_t tid,
+                                         PositionRanges &ranges) {
+  // A query loaded from a library has no tree to examine.
+  return node && node->positionRanges(header.get(), tid, ranges);
 }
 
 bool bamql::CheckIterator::wantChromosome(std::shared_ptr<bam_hdr_t> &header,
                                           uint32_t tid) {
+  if (useInterpreter()) {
+    return node->evaluateIndex(header.get(), tid);
+  }
   return index(header.get(), tid);
 }
 
 void bamql::CheckIterator::processRead(std::shared_ptr<bam_hdr_t> &header,
                                        std::shared_ptr<bam1_t> &read) {
+  if (useInterpreter()) {
+    bamql_read_context context = { 0, 0 };
+    readMatch(
+        node->evaluate(header.get(), read.get(), &context), header, read);
+    return;
+  }
   readMatch(filter(header.get(), read.get()), header, read);
+  countReads(1);
+}
+
+void bamql::CheckIterator::processBatch(
+    std::shared_ptr<bam_hdr_t> &header,
+    std::vector<std::shared_ptr<bam1_t>> &reads,
+    size_t count) {
+  if (batch == nullptr || useInterpreter()) {
+    ReadIterator::processBatch(header, reads, count);
+    return;
+  }
+  batch_reads.resize(count);
+  batch_matches.resize(count);
+  for (size_t it = 0; it < count; it++) {
+    batch_reads[it] = reads[it].get();
+  }
+  batch(header.get(), batch_reads.data(), count, batch_matches.data());
+  for (size_t it = 0; it < count; it++) {
+    readMatch(batch_matches[it], header, reads[it]);
+  }
+  countReads(count);
 }
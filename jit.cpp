@@ -15,20 +15,35 @@
  */
 
 #include <cstdio>
+#include <dlfcn.h>
 #include <iostream>
 #include <sstream>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include "bamql-jit.hpp"
 
 std::shared_ptr<llvm::ExecutionEngine> bamql::createEngine(
-    std::unique_ptr<llvm::Module> module) {
+    std::unique_ptr<llvm::Module> module, bool portable, bool cache) {
   std::string error;
   std::vector<std::string> attrs;
-  attrs.push_back("-avx"); // The AVX support (auto-vectoring) should be
-                           // disabled since the JIT isn't smart enough to
-                           // detect this, even though there is a detection
-                           // routine. In particular, it makes Valgrind not
-                           // work.
-  std::shared_ptr<llvm::ExecutionEngine> engine(
+  std::string cpu;
+  if (portable) {
+    attrs.push_back("-avx"); // Valgrind can't cope with AVX instructions, so
+                             // generate code for a generic processor with AVX
+                             // (and everything that depends on it) disabled.
+  } else {
+    // Target the processor we are running on and everything it supports,
+    // since the code will never leave this machine.
+    cpu = llvm::sys::getHostCPUName();
+    std::stringstream features(getHostCPUFeatures());
+    std::string feature;
+    while (std::getline(features, feature, ',')) {
+      attrs.push_back(feature);
+    }
+  }
+  auto engine =
       llvm::EngineBuilder(
 #if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 5
           module.release()
@@ -39,13 +54,114 @@ std::shared_ptr<llvm::ExecutionEngine> bamql::createEngine(
           )
           .setEngineKind(llvm::EngineKind::JIT)
           .setErrorStr(&error)
+          .setMCPU(cpu)
           .setMAttrs(attrs)
           .setUseMCJIT(true)
-          .create());
-  if (!engine) {
+          .create();
+  if (engine == nullptr) {
     std::cerr << error << std::endl;
+    return nullptr;
+  }
+  if (!cache) {
+    return std::shared_ptr<llvm::ExecutionEngine>(engine);
+  }
+  std::stringstream target;
+  target << cpu;
+  for (auto &attr : attrs) {
+    target << " " << attr;
+  }
+  // The cache must outlive the engine, so tie their lifetimes together.
+  auto object_cache = std::make_shared<DiskObjectCache>(target.str());
+  engine->setObjectCache(object_cache.get());
+  return std::shared_ptr<llvm::ExecutionEngine>(
+      engine, [object_cache](llvm::ExecutionEngine *e) { delete e; });
+}
+
+std::shared_ptr<llvm::ExecutionEngine> bamql::createEngine(
+    const std::string &bitcode, bool portable, bool cache) {
+  std::shared_ptr<llvm::LLVMContext> context(new llvm::LLVMContext());
+  std::unique_ptr<llvm::MemoryBuffer> buffer(
+      llvm::MemoryBuffer::getMemBuffer(bitcode, "bamql", false));
+  std::unique_ptr<llvm::Module> module;
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 4
+  std::string error;
+  module.reset(llvm::ParseBitcodeFile(buffer.get(), *context, &error));
+  if (!module) {
+    std::cerr << error << std::endl;
+    return nullptr;
+  }
+#else
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 5
+  auto result = llvm::parseBitcodeFile(buffer.get(), *context);
+#else
+  auto result = llvm::parseBitcodeFile(buffer->getMemBufferRef(), *context);
+#endif
+  if (!result) {
+    std::cerr << result.getError().message() << std::endl;
+    return nullptr;
+  }
+  module.reset(result.get());
+#endif
+  auto engine = createEngine(std::move(module), portable, cache);
+  if (!engine) {
+    return nullptr;
+  }
+  // The engine must be freed before the context that holds its module.
+  return std::shared_ptr<llvm::ExecutionEngine>(
+      engine.get(),
+      [engine, context](llvm::ExecutionEngine *e) mutable { engine.reset(); });
+}
+
+std::shared_ptr<void> bamql::openLibrary(const char *file_name) {
+  // Without a slash, dlopen would search the library path rather than the
+  // current directory.
+  std::string path(file_name);
+  if (path.find('/') == std::string::npos) {
+    path = "./" + path;
+  }
+  auto handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (handle == nullptr) {
+    std::cerr << dlerror() << std::endl;
+    return nullptr;
+  }
+  return std::shared_ptr<void>(handle, dlclose);
+}
+
+/**
+ * Find a function in a shared library and return it as the correct type.
+ */
+template <typename T>
+static bool findSymbol(void *handle, const std::string &name, T &result) {
+  union {
+    T func;
+    void *ptr;
+  } symbol;
+  symbol.ptr = dlsym(handle, name.c_str());
+  if (symbol.ptr == nullptr) {
+    std::cerr << dlerror() << std::endl;
+    return false;
+  }
+  result = symbol.func;
+  return true;
+}
+
+bool bamql::findLibraryQuery(std::shared_ptr<void> &library,
+                             const std::string &name,
+                             FilterFunction &filter,
+                             IndexFunction &index,
+                             BatchFunction &batch) {
+  if (!findSymbol(library.get(), name, filter) ||
+      !findSymbol(library.get(), name + "_index", index)) {
+    return false;
   }
-  return engine;
+  // Libraries from older versions of bamql-compile have no batch function.
+  union {
+    BatchFunction func;
+    void *ptr;
+  } symbol;
+  symbol.ptr = dlsym(library.get(), (name + "_batch").c_str());
+  batch = symbol.func;
+  return true;
 }
 
 std::shared_ptr<bam_hdr_t> bamql::appendProgramToHeader(
@@ -14,71 +14,54 @@
  * credit be given to OICR scientists, as scientifically appropriate.
  */
 
-#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <uuid.h>
+#include <llvm/Bitcode/ReaderWriter.h>
 #include <llvm/ExecutionEngine/MCJIT.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
 #include "bamql.hpp"
 #include "bamql-jit.hpp"
 
-/**
- * A type for a chaining behaviour. This is a bitfield where the lowest bit is
- * whether to accept the read on no-match and the next bit is whether to accept
- * the read on match.
- */
-typedef unsigned int ChainPattern;
-
 /**
  * The different chaining behaviours allowed.
  */
-std::map<std::string, ChainPattern> known_chains = { { "parallel", 3 },
-                                                     { "series", 2 },
-                                                     { "shuttle", 1 } };
+std::map<std::string, bamql::ChainPattern> known_chains = {
+  { "parallel", 3 }, { "series", 2 }, { "shuttle", 1 }
+};
 
-bool checkChain(ChainPattern chain, bool matches) {
+bool checkChain(bamql::ChainPattern chain, bool matches) {
   return chain & (1 << matches);
 }
 
 /**
- * One link of a chain. It checks the filter, writes matching reads to a file,
- * and propagates the read to the next link in the chain.
+ * One link of a chain. It writes the reads that reach and match its query to
+ * a file.
  */
-class OutputWrangler : public bamql::CheckIterator {
+class OutputWrangler {
 public:
-  OutputWrangler(std::shared_ptr<llvm::ExecutionEngine> &engine,
-                 std::shared_ptr<bamql::Generator> &generator,
-                 std::string &query_,
-                 std::shared_ptr<bamql::AstNode> &node,
-                 std::string name,
-                 ChainPattern c,
+  OutputWrangler(std::string &query_,
                  std::string file_name_,
-                 std::shared_ptr<htsFile> &o,
-                 std::shared_ptr<OutputWrangler> &n)
-      : bamql::CheckIterator::CheckIterator(engine, generator, node, name),
-        chain(c), file_name(file_name_), output_file(o), query(query_),
-        next(n) {}
-  virtual void prepareExecution() {
-    CheckIterator::prepareExecution();
-    if (next) {
-      next->prepareExecution();
-    }
-  }
+                 std::shared_ptr<htsFile> &o)
+      : query(query_), file_name(file_name_), output_file(o) {}
 
   /**
-   * We want this chromosome if our query is interested or the next link can
-   * make use of it _if_ it will see it upon failure (otherwise, its behaviour
-   * is determined by ours.
+   * Write the header for this link's output and return the header the next
+   * link should see.
    */
-  bool wantChromosome(std::shared_ptr<bam_hdr_t> &header, uint32_t tid) {
-    return CheckIterator::wantChromosome(header, tid) ||
-           next && checkChain(chain, false) &&
-               next->wantChromosome(header, tid);
-  }
-
-  void ingestHeader(std::shared_ptr<bam_hdr_t> &header) {
+  std::shared_ptr<bam_hdr_t> ingestHeader(std::shared_ptr<bam_hdr_t> &header,
+                                          bamql::ChainPattern chain) {
     auto version = bamql::version();
     std::stringstream name;
     name << "bamql-chain ";
@@ -100,59 +83,379 @@ public:
     if (output_file) {
       sam_hdr_write(output_file.get(), copy.get());
     }
-    if (next)
-      next->ingestHeader(chain == 3 ? header : copy);
+    return chain == 3 ? header : copy;
   }
 
-  /**
-   * Write the read if it matches and then pass it down the chain if
-   * appropriate.
-   */
-  void readMatch(bool matches,
-                 std::shared_ptr<bam_hdr_t> &header,
+  void writeRead(std::shared_ptr<bam_hdr_t> &header,
                  std::shared_ptr<bam1_t> &read) {
-    if (matches) {
-      count++;
-      if (output_file) {
-        sam_write1(output_file.get(), header.get(), read.get());
-      }
-    }
-    if (next && checkChain(chain, matches)) {
-      next->processRead(header, read);
+    count++;
+    if (output_file) {
+      sam_write1(output_file.get(), header.get(), read.get());
     }
   }
 
   void write_summary() {
     std::cout << count << " " << file_name << std::endl;
-    if (next) {
-      next->write_summary();
-    }
   }
 
 private:
-  ChainPattern chain;
   std::shared_ptr<htsFile> output_file;
-  bamql::FilterFunction filter;
-  bamql::IndexFunction index;
-  std::shared_ptr<OutputWrangler> next;
   std::string file_name;
   std::string query;
   size_t count = 0;
 };
 
+/**
+ * The number of consecutive links that are compiled together. Each group is
+ * compiled in a module of its own, so groups can be compiled at the same time,
+ * and a group is only compiled once a read needs it. Subexpressions are only
+ * shared between the queries in a group.
+ */
+#define SEGMENT_LENGTH 16
+static_assert(SEGMENT_LENGTH <= bamql::MAX_CHAIN_LENGTH,
+              "Segments are too long to compile into one function.");
+
+/**
+ * Some consecutive links of a chain, compiled together into a function that
+ * checks a read against all of them.
+ */
+class ChainSegment {
+public:
+  /**
+   * Generate the code for the queries. This uses the global LLVM context, so
+   * it must be done on the main thread, but the module is then copied into a
+   * context of its own so `compile` may be called from any thread.
+   */
+  ChainSegment(std::vector<std::shared_ptr<bamql::AstNode>> queries_,
+               bamql::ChainPattern chain,
+               bool portable_,
+               bool cache_)
+      : queries(queries_), portable(portable_), cache(cache_) {
+    std::unique_ptr<llvm::Module> module(
+        new llvm::Module("bamql", llvm::getGlobalContext()));
+    auto generator = std::make_shared<bamql::Generator>(module.get(), nullptr);
+    bamql::shareCommonSubexpressions(queries);
+    bamql::createChainFunction(generator, "chain", queries, chain);
+    bamql::createChainDispatchFunction(generator, "chain_dispatch", queries);
+    bamql::linkRuntime(module.get());
+    llvm::raw_string_ostream stream(bitcode);
+    llvm::WriteBitcodeToFile(module.get(), stream);
+    stream.flush();
+  }
+
+  size_t size() const { return queries.size(); }
+
+  /**
+   * Determine if any query in this segment can match reads on a chromosome.
+   * If not, the segment need not be compiled for them.
+   */
+  bool wantChromosome(bam_hdr_t *header, int32_t tid) {
+    if (tid < 0) {
+      return true;
+    }
+    if (wanted.empty()) {
+      wanted.resize(header->n_targets, -1);
+    }
+    if (wanted[tid] < 0) {
+      wanted[tid] = false;
+      for (auto it = queries.begin(); it != queries.end(); it++) {
+        if ((*it)->evaluateIndex(header, tid)) {
+          wanted[tid] = true;
+          break;
+        }
+      }
+    }
+    return wanted[tid];
+  }
+
+  /**
+   * Compile the segment and fill in the dispatch table for the header.
+   */
+  void compile(bam_hdr_t *header) {
+    engine = bamql::createEngine(bitcode, portable, cache);
+    if (!engine) {
+      return;
+    }
+    engine->finalizeObject();
+    chain_fn = bamql::getNativeFunction<ChainFunction>(
+        engine, engine->FindFunctionNamed("chain"));
+    auto dispatch_fn = bamql::getNativeFunction<DispatchFunction>(
+        engine, engine->FindFunctionNamed("chain_dispatch"));
+    table.resize(header->n_targets + 1);
+    for (int32_t tid = 0; tid <= header->n_targets; tid++) {
+      table[tid] = dispatch_fn(header, tid);
+    }
+  }
+
+  /**
+   * Find the queries in this segment a read reaches and matches.
+   */
+  uint64_t evaluate(bam_hdr_t *header, bam1_t *read) {
+    return chain_fn(header, read, table.data());
+  }
+
+  /**
+   * Whether the segment has been compiled. This is only set by the
+   * `Compiler`, once `compile` has returned.
+   */
+  std::atomic<bool> ready{ false };
+  /**
+   * Whether the segment has been compiled successfully.
+   */
+  bool compiled() const { return chain_fn != nullptr; }
+
+private:
+  typedef uint64_t (*ChainFunction)(bam_hdr_t *, bam1_t *, const uint64_t *);
+  typedef uint64_t (*DispatchFunction)(bam_hdr_t *, uint32_t);
+
+  std::vector<std::shared_ptr<bamql::AstNode>> queries;
+  bool portable;
+  bool cache;
+  std::string bitcode;
+  std::shared_ptr<llvm::ExecutionEngine> engine;
+  ChainFunction chain_fn = nullptr;
+  std::vector<uint64_t> table;
+  std::vector<int8_t> wanted;
+};
+
+/**
+ * Compile the segments of a chain on a pool of threads, one per processor.
+ */
+class Compiler {
+public:
+  Compiler(std::shared_ptr<bam_hdr_t> &header_) : header(header_) {
+    auto threads = std::max(std::thread::hardware_concurrency(), 1U);
+    for (unsigned int it = 0; it < threads; it++) {
+      workers.push_back(std::thread([this]() { work(); }));
+    }
+  }
+  ~Compiler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    queued.notify_all();
+    for (auto it = workers.begin(); it != workers.end(); it++) {
+      it->join();
+    }
+  }
+
+  /**
+   * Start compiling a segment, if it hasn't been already.
+   */
+  void request(ChainSegment *segment) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (segment->ready || pending.count(segment) > 0) {
+      return;
+    }
+    pending.insert(segment);
+    queue.push_back(segment);
+    queued.notify_one();
+  }
+
+  /**
+   * Wait for a segment to be compiled. If no thread has started on it yet,
+   * it is compiled by the caller rather than waiting for one.
+   */
+  void require(ChainSegment *segment) {
+    if (segment->ready) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!segment->ready && compiling.count(segment) == 0) {
+      compile(segment, lock);
+    } else {
+      finished.wait(lock, [segment]() { return segment->ready.load(); });
+    }
+  }
+
+private:
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      queued.wait(lock, [this]() { return stopping || !queue.empty(); });
+      if (stopping) {
+        return;
+      }
+      auto segment = queue.front();
+      queue.pop_front();
+      // The segment may have been compiled by a thread that needed it first.
+      if (!segment->ready && compiling.count(segment) == 0) {
+        compile(segment, lock);
+      }
+    }
+  }
+  void compile(ChainSegment *segment, std::unique_lock<std::mutex> &lock) {
+    compiling.insert(segment);
+    lock.unlock();
+    segment->compile(header.get());
+    lock.lock();
+    segment->ready = true;
+    compiling.erase(segment);
+    pending.erase(segment);
+    finished.notify_all();
+  }
+
+  std::shared_ptr<bam_hdr_t> header;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable queued;
+  std::condition_variable finished;
+  std::deque<ChainSegment *> queue;
+  std::set<ChainSegment *> pending;
+  std::set<ChainSegment *> compiling;
+  bool stopping = false;
+};
+
+/**
+ * A chain of queries. Each read is checked against each segment of the chain
+ * at once, which produces the set of links that should receive it.
+ */
+class ChainIterator : public bamql::ReadIterator {
+public:
+  /**
+   * Generate the code for the queries, to be compiled once reads need it.
+   */
+  ChainIterator(std::vector<std::shared_ptr<bamql::AstNode>> &queries_,
+                bamql::ChainPattern c,
+                std::vector<std::shared_ptr<OutputWrangler>> &links_,
+                bool portable,
+                bool cache)
+      : queries(queries_), chain(c), links(links_) {
+    for (size_t start = 0; start < queries.size(); start += SEGMENT_LENGTH) {
+      std::vector<std::shared_ptr<bamql::AstNode>> segment_queries(
+          queries.begin() + start,
+          queries.begin() + std::min(start + SEGMENT_LENGTH, queries.size()));
+      segments.push_back(std::unique_ptr<ChainSegment>(
+          new ChainSegment(segment_queries, chain, portable, cache)));
+    }
+  }
+  /**
+   * Use queries that have already been compiled to native code. Each is
+   * evaluated separately.
+   */
+  ChainIterator(std::shared_ptr<void> &library_,
+                std::vector<bamql::FilterFunction> &filters_,
+                std::vector<bamql::IndexFunction> &indices_,
+                bamql::ChainPattern c,
+                std::vector<std::shared_ptr<OutputWrangler>> &links_)
+      : library(library_), filters(filters_), indices(indices_), chain(c),
+        links(links_) {}
+
+  /**
+   * We want this chromosome if a link's query is interested or the next link
+   * can make use of it _if_ it will see it upon failure (otherwise, its
+   * behaviour is determined by the earlier link).
+   */
+  bool wantChromosome(std::shared_ptr<bam_hdr_t> &header, uint32_t tid) {
+    bool want = false;
+    for (size_t it = links.size(); it > 0; it--) {
+      bool link_want = library ? indices[it - 1](header.get(), tid)
+                               : queries[it - 1]->evaluateIndex(header.get(),
+                                                                tid);
+      want = link_want || want && checkChain(chain, false);
+    }
+    return want;
+  }
+
+  void ingestHeader(std::shared_ptr<bam_hdr_t> &header) {
+    auto link_header = header;
+    for (auto it = links.begin(); it != links.end(); it++) {
+      link_header = (*it)->ingestHeader(link_header, chain);
+    }
+    if (!segments.empty()) {
+      compiler.reset(new Compiler(header));
+    }
+  }
+
+  void processRead(std::shared_ptr<bam_hdr_t> &header,
+                   std::shared_ptr<bam1_t> &read) {
+    if (library) {
+      for (size_t it = 0; it < filters.size(); it++) {
+        bool match = filters[it](header.get(), read.get());
+        if (match) {
+          links[it]->writeRead(header, read);
+        }
+        if (!checkChain(chain, match)) {
+          break;
+        }
+      }
+      return;
+    }
+
+    // Reads are grouped by chromosome, so on reaching a new one, start
+    // compiling everything that will be needed for it.
+    auto tid = read->core.tid;
+    if (tid != current_tid) {
+      current_tid = tid;
+      for (auto it = segments.begin(); it != segments.end(); it++) {
+        if ((*it)->wantChromosome(header.get(), tid)) {
+          compiler->request(it->get());
+        }
+      }
+    }
+
+    bool reached = true;
+    size_t link = 0;
+    for (auto it = segments.begin(); it != segments.end() && reached; it++) {
+      // If no query in the segment can match reads on this chromosome, there
+      // is no need to compile it; the read just passes through.
+      uint64_t matches = 0;
+      if ((*it)->wantChromosome(header.get(), tid)) {
+        compiler->require(it->get());
+        if (!(*it)->compiled()) {
+          std::cerr << "Failed to compile queries." << std::endl;
+          exit(1);
+        }
+        matches = (*it)->evaluate(header.get(), read.get());
+      }
+      for (size_t index = 0; index < (*it)->size() && reached; index++) {
+        bool match = matches & (1ULL << index);
+        if (match) {
+          links[link + index]->writeRead(header, read);
+        }
+        reached = checkChain(chain, match);
+      }
+      link += (*it)->size();
+    }
+  }
+
+  void write_summary() {
+    for (auto it = links.begin(); it != links.end(); it++) {
+      (*it)->write_summary();
+    }
+  }
+
+private:
+  std::shared_ptr<void> library;
+  std::vector<std::shared_ptr<bamql::AstNode>> queries;
+  std::vector<bamql::FilterFunction> filters;
+  std::vector<bamql::IndexFunction> indices;
+  bamql::ChainPattern chain;
+  std::vector<std::shared_ptr<OutputWrangler>> links;
+  // The compiler uses the segments, so it must be destroyed first.
+  std::vector<std::unique_ptr<ChainSegment>> segments;
+  std::unique_ptr<Compiler> compiler;
+  int32_t current_tid = INT32_MIN;
+};
+
 /**
  * Compile many queries, then arrange them into a chain and squirt reads
  * through it.
  */
 int main(int argc, char *const *argv) {
   const char *input_filename = nullptr;
+  const char *library_filename = nullptr;
   bool binary = false;
-  ChainPattern chain = known_chains["parallel"];
+  bamql::ChainPattern chain = known_chains["parallel"];
   bool help = false;
   bool ignore_index = false;
+  bool portable = false;
+  bool use_cache = true;
+  bool clear_cache = false;
   int c;
 
-  while ((c = getopt(argc, argv, "bc:f:hI")) != -1) {
+  while ((c = getopt(argc, argv, "bc:f:hIkKL:P")) != -1) {
     switch (c) {
     case 'b':
       binary = true;
@@ -171,9 +474,21 @@ int main(int argc, char *const *argv) {
     case 'I':
       ignore_index = true;
       break;
+    case 'k':
+      use_cache = false;
+      break;
+    case 'K':
+      clear_cache = true;
+      break;
+    case 'L':
+      library_filename = optarg;
+      break;
     case 'f':
       input_filename = optarg;
       break;
+    case 'P':
+      portable = true;
+      break;
     case '?':
       fprintf(stderr, "Option -%c is not valid.\n", optopt);
       return 1;
@@ -182,8 +497,9 @@ int main(int argc, char *const *argv) {
     }
   }
   if (help) {
-    std::cout << argv[0] << " [-b] [-c] [-I] [-v] -f input.bam "
-                            " query1 output1.bam ..." << std::endl;
+    std::cout << argv[0] << " [-b] [-c] [-I] [-k] [-K] [-L queries.so] [-P] "
+                            "[-v] -f input.bam query1 output1.bam ..."
+              << std::endl;
     std::cout << "Filter a BAM/SAM file based on the provided query. For "
                  "details, see the man page." << std::endl;
     std::cout << "\t-b\tThe input file is binary (BAM) not text (SAM)."
@@ -191,10 +507,30 @@ int main(int argc, char *const *argv) {
     std::cout << "\t-c\tChain the queries, rather than use them independently."
               << std::endl;
     std::cout << "\t-I\tDo not use the index, even if it exists." << std::endl;
+    std::cout << "\t-k\tDo not use the cache of compiled queries."
+              << std::endl;
+    std::cout << "\t-K\tEmpty the cache of compiled queries." << std::endl;
+    std::cout << "\t-L\tA shared library of queries produced by "
+                 "bamql-compile. Queries are then the names of queries in the "
+                 "library rather than queries to compile." << std::endl;
+    std::cout << "\t-P\tGenerate portable code rather than using every "
+                 "feature of this processor. This is needed for Valgrind."
+              << std::endl;
     std::cout << "\t-v\tPrint some information along the way." << std::endl;
     return 0;
   }
 
+  if (clear_cache) {
+    if (!bamql::clearCache()) {
+      std::cerr << "Failed to clear cache in " << bamql::getCacheDirectory()
+                << std::endl;
+      return 1;
+    }
+    if (input_filename == nullptr && optind == argc) {
+      return 0;
+    }
+  }
+
   if (optind >= argc) {
     std::cout << "Need a query and a BAM file." << std::endl;
     return 1;
@@ -207,21 +543,29 @@ int main(int argc, char *const *argv) {
     std::cout << "An input file is required." << std::endl;
     return 1;
   }
-  // Create a new LLVM module and JIT
-  LLVMInitializeNativeTarget();
-  llvm::InitializeNativeTargetAsmParser();
-  llvm::InitializeNativeTargetAsmPrinter();
-  std::unique_ptr<llvm::Module> module(
-      new llvm::Module("bamql", llvm::getGlobalContext()));
-  auto generator = std::make_shared<bamql::Generator>(module.get(), nullptr);
-  auto engine = bamql::createEngine(std::move(module));
-  if (!engine) {
-    return 1;
+  std::shared_ptr<void> library;
+  if (library_filename != nullptr) {
+    // Use precompiled queries and skip LLVM entirely.
+    library = bamql::openLibrary(library_filename);
+    if (!library) {
+      return 1;
+    }
+  } else {
+    // Queries are compiled on several threads at once.
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 4
+    llvm::llvm_start_multithreaded();
+#endif
+    LLVMInitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmParser();
+    llvm::InitializeNativeTargetAsmPrinter();
   }
 
   // Prepare a chain of wranglers.
-  std::shared_ptr<OutputWrangler> output;
-  for (auto it = argc - 2; it >= optind; it -= 2) {
+  std::vector<std::shared_ptr<OutputWrangler>> links;
+  std::vector<std::shared_ptr<bamql::AstNode>> queries;
+  std::vector<bamql::FilterFunction> filters;
+  std::vector<bamql::IndexFunction> indices;
+  for (auto it = optind; it < argc; it += 2) {
     // Prepare the output file.
     std::shared_ptr<htsFile> output_file;
     if (strcmp("-", argv[it + 1]) != 0) {
@@ -232,29 +576,37 @@ int main(int argc, char *const *argv) {
         return 1;
       }
     }
-    // Parse the input query.
     std::string query(argv[it]);
+    links.push_back(std::make_shared<OutputWrangler>(
+        query, std::string(argv[it + 1]), output_file));
+    if (library) {
+      bamql::FilterFunction filter;
+      bamql::IndexFunction index;
+      bamql::BatchFunction batch;
+      if (!bamql::findLibraryQuery(library, query, filter, index, batch)) {
+        return 1;
+      }
+      filters.push_back(filter);
+      indices.push_back(index);
+      continue;
+    }
+
+    // Parse the input query.
     auto ast =
         bamql::AstNode::parseWithLogging(query, bamql::getDefaultPredicates());
     if (!ast) {
       return 1;
     }
-
-    // Add the link to the chain.
-    std::stringstream function_name;
-    function_name << "filter" << it;
-    output = std::make_shared<OutputWrangler>(engine,
-                                              generator,
-                                              query,
-                                              ast,
-                                              function_name.str(),
-                                              chain,
-                                              std::string(argv[it + 1]),
-                                              output_file,
-                                              output);
+    queries.push_back(ast);
+  }
+  std::shared_ptr<ChainIterator> output;
+  if (library) {
+    output = std::make_shared<ChainIterator>(
+        library, filters, indices, chain, links);
+  } else {
+    output = std::make_shared<ChainIterator>(
+        queries, chain, links, portable, use_cache);
   }
-  engine->finalizeObject();
-  output->prepareExecution();
 
   // Run the chain.
   if (output->processFile(input_filename, binary, ignore_index)) {
@@ -14,6 +14,7 @@
  * credit be given to OICR scientists, as scientifically appropriate.
  */
 
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fstream>
 #include <iostream>
@@ -50,6 +51,9 @@ public:
     return state->CreateCall2(index, header, chromosome);
   }
   bool usesIndex() { return true; }
+  unsigned int cost() { return 6; }
+  // The other query might be random, so it can't be reordered.
+  bool hasSideEffects() { return true; }
   void writeDebug(bamql::GenerateState &state) {}
 
 private:
@@ -99,31 +103,90 @@ llvm::Function *createExternFunction(
   return func;
 }
 
+/**
+ * Link an object file into a shared library, along with the libraries needed
+ * by the runtime, so that it can be loaded by `bamql -L`.
+ */
+bool linkSharedLibrary(const std::string &object_filename,
+                       const std::string &shared_filename) {
+  std::vector<std::string> args;
+  std::string arg;
+  std::stringstream linker(SHARED_LINKER);
+  while (linker >> arg) {
+    args.push_back(arg);
+  }
+  args.push_back("-shared");
+  args.push_back("-o");
+  args.push_back(shared_filename);
+  args.push_back(object_filename);
+  std::stringstream libs(SHARED_LIBS);
+  while (libs >> arg) {
+    args.push_back(arg);
+  }
+  std::vector<char *> argv;
+  for (auto it = args.begin(); it != args.end(); it++) {
+    argv.push_back(const_cast<char *>(it->c_str()));
+  }
+  argv.push_back(nullptr);
+
+  auto pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    return false;
+  }
+  if (pid == 0) {
+    execvp(argv[0], argv.data());
+    perror(argv[0]);
+    _exit(127);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) == -1) {
+    perror("waitpid");
+    return false;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
 /**
  * Use LLVM to compile a query into object code.
  */
 int main(int argc, char *const *argv) {
   char *output = nullptr;
   char *output_header = nullptr;
+  char *output_shared = nullptr;
+  char *cpu = nullptr;
+  char *features = nullptr;
   bool help = false;
   bool dump = false;
   bool debug = false;
   int c;
 
-  while ((c = getopt(argc, argv, "dghH:o:")) != -1) {
+  while ((c = getopt(argc, argv, "C:dF:ghH:o:s:")) != -1) {
     switch (c) {
+    case 'C':
+      cpu = optarg;
+      break;
     case 'd':
       dump = true;
       break;
+    case 'F':
+      features = optarg;
+      break;
     case 'g':
       debug = true;
       break;
+    case 'h':
+      help = true;
+      break;
     case 'H':
       output_header = optarg;
       break;
     case 'o':
       output = optarg;
       break;
+    case 's':
+      output_shared = optarg;
+      break;
     case '?':
       fprintf(stderr, "Option -%c is not valid.\n", optopt);
       return 1;
@@ -132,13 +195,20 @@ int main(int argc, char *const *argv) {
     }
   }
   if (help) {
-    std::cout << argv[0] << "[-d] [-g] [-H output.h] [-o output.o] query.bamql"
+    std::cout << argv[0] << "[-C cpu] [-d] [-F features] [-g] [-H output.h] "
+                            "[-o output.o] [-s output.so] query.bamql"
               << std::endl;
     std::cout << "Compile a collection of queries to object code. For details, "
                  "see the man page." << std::endl;
+    std::cout << "\t-C\tThe processor to generate code for. If unspecified, "
+                 "it will be the processor of this machine." << std::endl;
     std::cout
         << "\t-d\tDump the human-readable LLVM bitcode to standard output."
         << std::endl;
+    std::cout << "\t-F\tThe processor features (e.g., +avx2,-avx512f) to "
+                 "generate code for. If unspecified, and no processor is "
+                 "specified, it will be the features of this machine."
+              << std::endl;
     std::cout << "\t-g\tGenerate debugging symbols." << std::endl;
     std::cout
         << "\t-H\tThe C header file for functions produced. If unspecified, it "
@@ -146,6 +216,8 @@ int main(int argc, char *const *argv) {
     std::cout
         << "\t-o\tThe output file containing the object code. If unspecified, "
            "it will be the function name suffixed by `.o'." << std::endl;
+    std::cout << "\t-s\tAlso link the object code into a shared library, "
+                 "which can be used by bamql -L." << std::endl;
     return 0;
   }
 
@@ -193,6 +265,8 @@ int main(int argc, char *const *argv) {
   }
   header_file << "#pragma once" << std::endl;
   header_file << "#include <stdbool.h>" << std::endl;
+  header_file << "#include <stddef.h>" << std::endl;
+  header_file << "#include <stdint.h>" << std::endl;
   header_file << "#include <htslib/sam.h>" << std::endl;
   header_file << "#ifdef __cplusplus" << std::endl;
   header_file << "extern \"C\" {" << std::endl;
@@ -245,10 +319,15 @@ int main(int argc, char *const *argv) {
       state.parseCharInSpace('=');
       auto ast = bamql::AstNode::parse(state, predicates);
       state.parseCharInSpace(';');
+      bamql::simplify(ast);
+      ast->optimise(nullptr);
+      bamql::shareCommonSubexpressions(ast);
       if (name.length() >= 6 &&
-          name.compare(name.length() - 6, 6, "_index") == 0) {
+          (name.compare(name.length() - 6, 6, "_index") == 0 ||
+           name.compare(name.length() - 6, 6, "_batch") == 0)) {
         std::cerr << argv[optind] << ":" << state.currentLine() << ": Name \""
-                  << name << "\" must not be end in \"_index\"." << std::endl;
+                  << name << "\" must not be end in \""
+                  << name.substr(name.length() - 6) << "\"." << std::endl;
         return 1;
       }
       if (defined_names.find(name) == defined_names.end()) {
@@ -272,10 +351,15 @@ int main(int argc, char *const *argv) {
                   << std::endl;
       header_file << "extern bool " << index_name.str()
                   << "(bam_hdr_t*, uint32_t);" << std::endl;
+      std::stringstream batch_name;
+      batch_name << name << "_batch";
+      header_file << "extern void " << batch_name.str()
+                  << "(bam_hdr_t*, bam1_t**, size_t, uint8_t*);" << std::endl;
 
       auto node = std::make_shared<ExistingFunction>(
           ast->createFilterFunction(generator, name),
           ast->createIndexFunction(generator, index_name.str()));
+      ast->createBatchFunction(generator, batch_name.str());
       predicates[name] = [=](bamql::ParseState &state) { return node; };
     } while (!state.empty());
   } catch (bamql::ParseError e) {
@@ -287,6 +371,8 @@ int main(int argc, char *const *argv) {
   header_file << "}" << std::endl;
   header_file << "#endif" << std::endl;
 
+  bamql::linkRuntime(module.get());
+
   if (dump) {
     module->dump();
   }
@@ -302,10 +388,20 @@ int main(int argc, char *const *argv) {
     std::cerr << error << std::endl;
     return 1;
   }
+  std::string target_cpu;
+  std::string target_features;
+  if (cpu == nullptr) {
+    target_cpu = llvm::sys::getHostCPUName();
+    target_features =
+        features == nullptr ? bamql::getHostCPUFeatures() : features;
+  } else {
+    target_cpu = cpu;
+    target_features = features == nullptr ? "" : features;
+  }
   std::shared_ptr<llvm::TargetMachine> target_machine(
       target->createTargetMachine(target_triple,
-                                  llvm::sys::getHostCPUName(),
-                                  "",
+                                  target_cpu,
+                                  target_features,
                                   llvm::TargetOptions(),
                                   llvm::Reloc::PIC_,
                                   llvm::CodeModel::Default));
@@ -325,30 +421,40 @@ int main(int argc, char *const *argv) {
   pass_man.add(dlp);
 #endif
 
+  auto object_filename = createFileName(argv[optind], output, ".o");
+  {
+    // The object file must be closed before it can be linked.
 #if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 5
-  std::string error_c;
+    std::string error_c;
 #else
-  std::error_code error_c;
+    std::error_code error_c;
 #endif
-  llvm::raw_fd_ostream output_stream(
-      createFileName(argv[optind], output, ".o").c_str(),
-      error_c,
-      llvm::sys::fs::F_None);
-  if (error.length() > 0) {
-    std::cerr << error << std::endl;
-    return 1;
-  }
+    llvm::raw_fd_ostream output_stream(
+        object_filename.c_str(), error_c, llvm::sys::fs::F_None);
+    if (error.length() > 0) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+
+    llvm::formatted_raw_ostream raw_output_stream(output_stream);
 
-  llvm::formatted_raw_ostream raw_output_stream(output_stream);
+    if (target_machine->addPassesToEmitFile(
+            pass_man,
+            raw_output_stream,
+            llvm::TargetMachine::CGFT_ObjectFile,
+            false)) {
+      std::cerr << "Cannot create object file on this architecture."
+                << std::endl;
+      return 1;
+    }
+    pass_man.run(*module);
+  }
 
-  if (target_machine->addPassesToEmitFile(pass_man,
-                                          raw_output_stream,
-                                          llvm::TargetMachine::CGFT_ObjectFile,
-                                          false)) {
-    std::cerr << "Cannot create object file on this architecture." << std::endl;
+  if (output_shared != nullptr &&
+      !linkSharedLibrary(object_filename, output_shared)) {
+    std::cerr << "Could not create shared library." << std::endl;
     return 1;
   }
-  pass_man.run(*module);
 
   return 0;
 }
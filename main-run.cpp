@@ -20,25 +20,45 @@
 #include <sys/stat.h>
 #include <uuid.h>
 #include <llvm/ExecutionEngine/MCJIT.h>
-#include <llvm/Support/TargetSelect.h>
 #include "bamql.hpp"
 #include "bamql-jit.hpp"
 
+/**
+ * The number of reads to profile before recompiling an adaptive query.
+ */
+#define ADAPTIVE_READS 100000
+
 /**
  * Handler for output collection. Shunts reads into appropriate files and tracks
  * stats.
  */
 class DataCollector : public bamql::CheckIterator {
 public:
-  DataCollector(std::shared_ptr<llvm::ExecutionEngine> &engine,
+  DataCollector(std::unique_ptr<llvm::Module> module,
                 std::shared_ptr<bamql::Generator> &generator,
                 std::string &query_,
                 std::shared_ptr<bamql::AstNode> &node,
                 bool verbose_,
                 std::shared_ptr<htsFile> &a,
+                std::shared_ptr<htsFile> &r,
+                bool portable,
+                bool cache)
+      : bamql::CheckIterator::CheckIterator(std::move(module),
+                                            generator,
+                                            node,
+                                            std::string("filter"),
+                                            portable,
+                                            cache),
+        query(query_), verbose(verbose_), accept(a), reject(r) {}
+  DataCollector(std::shared_ptr<void> &library,
+                bamql::FilterFunction filter,
+                bamql::IndexFunction index,
+                bamql::BatchFunction batch,
+                std::string &query_,
+                bool verbose_,
+                std::shared_ptr<htsFile> &a,
                 std::shared_ptr<htsFile> &r)
-      : bamql::CheckIterator::CheckIterator(
-            engine, generator, node, std::string("filter")),
+      : bamql::CheckIterator::CheckIterator(library, filter, index, batch),
         query(query_), verbose(verbose_), accept(a), reject(r) {}
   void ingestHeader(std::shared_ptr<bam_hdr_t> &header) {
     auto version = bamql::version();
@@ -96,15 +116,24 @@ int main(int argc, char *const *argv) {
   std::shared_ptr<htsFile> reject; // The file where reads not matching the
                                    // query will be placed.
   char *bam_filename = nullptr;
+  char *library_filename = nullptr;
   char *query_filename = nullptr;
+  char *query_name = nullptr;
+  bool adaptive = false;
   bool binary = false;
   bool help = false;
   bool verbose = false;
   bool ignore_index = false;
+  bool portable = false;
+  bool use_cache = true;
+  bool clear_cache = false;
   int c;
 
-  while ((c = getopt(argc, argv, "bhf:Io:O:q:v")) != -1) {
+  while ((c = getopt(argc, argv, "abhf:IkKL:n:o:O:Pq:v")) != -1) {
     switch (c) {
+    case 'a':
+      adaptive = true;
+      break;
     case 'b':
       binary = true;
       break;
@@ -117,6 +146,18 @@ int main(int argc, char *const *argv) {
     case 'I':
       ignore_index = true;
       break;
+    case 'k':
+      use_cache = false;
+      break;
+    case 'K':
+      clear_cache = true;
+      break;
+    case 'L':
+      library_filename = optarg;
+      break;
+    case 'n':
+      query_name = optarg;
+      break;
     case 'o':
       accept = bamql::open(optarg, "wb");
       if (!accept) {
@@ -130,6 +171,9 @@ int main(int argc, char *const *argv) {
         perror(optarg);
       }
       break;
+    case 'P':
+      portable = true;
+      break;
     case 'q':
       query_filename = optarg;
       break;
@@ -146,26 +190,62 @@ int main(int argc, char *const *argv) {
   if (help) {
     std::cout
         << argv[0]
-        << " [-b] [-I] [-o accepted_reads.bam] [-O "
-           "rejected_reads.bam] [-v] -f input.bam {query | -q query.bamql}"
+        << " [-a] [-b] [-I] [-k] [-K] [-o accepted_reads.bam] [-O "
+           "rejected_reads.bam] [-P] [-v] -f input.bam {query | -q "
+           "query.bamql | -L queries.so -n name}"
         << std::endl;
     std::cout << "Filter a BAM/SAM file based on the provided query. For "
                  "details, see the man page." << std::endl;
+    std::cout << "\t-a\tProfile the query on the first reads, then reorder "
+                 "and recompile it to suit the data." << std::endl;
     std::cout << "\t-b\tThe input file is binary (BAM) not text (SAM)."
               << std::endl;
     std::cout << "\t-f\tThe input file to read." << std::endl;
     std::cout << "\t-I\tDo not use the index, even if it exists." << std::endl;
+    std::cout << "\t-k\tDo not use the cache of compiled queries."
+              << std::endl;
+    std::cout << "\t-K\tEmpty the cache of compiled queries." << std::endl;
+    std::cout << "\t-L\tA shared library of queries produced by "
+                 "bamql-compile. The query named by -n will be used instead "
+                 "of compiling one." << std::endl;
+    std::cout << "\t-n\tThe name of the query to use from the library."
+              << std::endl;
     std::cout << "\t-o\tThe output file for reads that pass the query."
               << std::endl;
     std::cout << "\t-O\tThe output file for reads that fail the query."
               << std::endl;
+    std::cout << "\t-P\tGenerate portable code rather than using every "
+                 "feature of this processor. This is needed for Valgrind."
+              << std::endl;
     std::cout << "\t-q\tA file containing the query, instead of providing it "
                  "on the command line." << std::endl;
     std::cout << "\t-v\tPrint some information along the way." << std::endl;
     return 0;
   }
 
-  if (query_filename == nullptr) {
+  if (clear_cache) {
+    if (!bamql::clearCache()) {
+      std::cerr << "Failed to clear cache in " << bamql::getCacheDirectory()
+                << std::endl;
+      return 1;
+    }
+    if (bam_filename == nullptr && query_filename == nullptr &&
+        optind == argc) {
+      return 0;
+    }
+  }
+
+  if (library_filename != nullptr) {
+    if (query_name == nullptr) {
+      std::cout << "Need a query name to use from the library." << std::endl;
+      return 1;
+    }
+    if (query_filename != nullptr || argc - optind != 0) {
+      std::cout << "No query can be provided if a library is given."
+                << std::endl;
+      return 1;
+    }
+  } else if (query_filename == nullptr) {
     if (argc - optind != 1) {
       std::cout << "Need a query." << std::endl;
       return 1;
@@ -182,8 +262,30 @@ int main(int argc, char *const *argv) {
     return 1;
   }
 
+  std::unique_ptr<DataCollector> stats;
   std::string query_content;
-  if (query_filename == nullptr) {
+  if (library_filename != nullptr) {
+    // Use the precompiled query and skip LLVM entirely.
+    query_content = std::string(library_filename) + ":" + query_name;
+    auto library = bamql::openLibrary(library_filename);
+    if (!library) {
+      return 1;
+    }
+    bamql::FilterFunction filter;
+    bamql::IndexFunction index;
+    bamql::BatchFunction batch;
+    if (!bamql::findLibraryQuery(library, query_name, filter, index, batch)) {
+      return 1;
+    }
+    stats.reset(new DataCollector(library,
+                                  filter,
+                                  index,
+                                  batch,
+                                  query_content,
+                                  verbose,
+                                  accept,
+                                  reject));
+  } else if (query_filename == nullptr) {
     query_content = std::string(argv[optind]);
   } else {
     std::ifstream input_file(query_filename);
@@ -194,36 +296,51 @@ int main(int argc, char *const *argv) {
     query_content = std::string((std::istreambuf_iterator<char>(input_file)),
                                 std::istreambuf_iterator<char>());
   }
-  // Parse the input query.
-  auto ast = bamql::AstNode::parseWithLogging(query_content,
-                                              bamql::getDefaultPredicates());
-  if (!ast) {
-    return 1;
-  }
+  if (!stats) {
+    // Parse the input query.
+    auto ast = bamql::AstNode::parseWithLogging(query_content,
+                                                bamql::getDefaultPredicates());
+    if (!ast) {
+      return 1;
+    }
 
-  // Create a new LLVM module and our function
-  LLVMInitializeNativeTarget();
-  llvm::InitializeNativeTargetAsmParser();
-  llvm::InitializeNativeTargetAsmPrinter();
-  std::unique_ptr<llvm::Module> module(
-      new llvm::Module("bamql", llvm::getGlobalContext()));
+    // Create a new LLVM module and our function. The target and the engine
+    // are set up on the compiler thread.
+    std::unique_ptr<llvm::Module> module(
+        new llvm::Module("bamql", llvm::getGlobalContext()));
 
-  auto generator = std::make_shared<bamql::Generator>(module.get(), nullptr);
+    // Profiled code contains the addresses of the counters in this process,
+    // so it must not be cached.
+    auto generator = std::make_shared<bamql::Generator>(
+        module.get(),
+        nullptr,
+        adaptive ? std::make_shared<bamql::Profile>() : nullptr);
 
-  auto engine = bamql::createEngine(std::move(module));
-  if (!engine) {
-    std::cerr << "Failed to initialise LLVM." << std::endl;
-    return 1;
+    stats.reset(new DataCollector(std::move(module),
+                                  generator,
+                                  query_content,
+                                  ast,
+                                  verbose,
+                                  accept,
+                                  reject,
+                                  portable,
+                                  use_cache && !adaptive));
+    if (adaptive) {
+      stats->adaptAfter(ADAPTIVE_READS, portable, use_cache);
+    }
+    // Small files can be finished before the query is compiled, so start
+    // reading right away.
+    if (!stats->compileInBackground()) {
+      std::cerr << "Failed to initialise LLVM." << std::endl;
+      return 1;
+    }
   }
 
   // Process the input file.
-  DataCollector stats(
-      engine, generator, query_content, ast, verbose, accept, reject);
-  engine->finalizeObject();
-  stats.prepareExecution();
+  stats->prepareExecution();
 
-  if (stats.processFile(bam_filename, binary, ignore_index)) {
-    stats.writeSummary();
+  if (stats->processFile(bam_filename, binary, ignore_index)) {
+    stats->writeSummary();
     return 0;
   } else {
     return 1;
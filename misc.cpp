@@ -14,10 +14,15 @@
  * credit be given to OICR scientists, as scientifically appropriate.
  */
 
+#include <algorithm>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/Host.h>
 #include "bamql.hpp"
 
 namespace bamql {
-extern llvm::Module *define_runtime(llvm::Module *module);
+extern llvm::Module *getRuntimeModule();
+extern void declareRuntime(llvm::Module *module);
 
 llvm::Value *AstNode::generateIndex(GenerateState &state,
                                     llvm::Value *read,
@@ -27,6 +32,18 @@ llvm::Value *AstNode::generateIndex(GenerateState &state,
 
 bool AstNode::usesIndex() { return false; }
 
+bool AstNode::indexIsExact() { return false; }
+
+bool AstNode::isInterpretable() { return false; }
+
+bool AstNode::evaluate(bam_hdr_t *header,
+                       bam1_t *read,
+                       bamql_read_context *context) {
+  llvm::report_fatal_error("This query cannot be interpreted.");
+}
+
+bool AstNode::evaluateIndex(bam_hdr_t *header, uint32_t tid) { return true; }
+
 llvm::Function *AstNode::createFunction(std::shared_ptr<Generator> &generator,
                                         llvm::StringRef name,
                                         llvm::StringRef param_name,
@@ -49,6 +66,9 @@ llvm::Function *AstNode::createFunction(std::shared_ptr<Generator> &generator,
   header_value->setName("header");
   auto param_value = args++;
   param_value->setName(param_name);
+  if (member == &bamql::AstNode::generate) {
+    state.startRead(param_value);
+  }
   this->writeDebug(state);
   state->CreateRet(member == nullptr
                        ? llvm::ConstantInt::getTrue(llvm::getGlobalContext())
@@ -77,6 +97,248 @@ llvm::Function *AstNode::createIndexFunction(
                                           : nullptr);
 }
 
+llvm::Function *AstNode::createBatchFunction(
+    std::shared_ptr<Generator> &generator, llvm::StringRef name) {
+  auto read_type =
+      llvm::PointerType::get(bamql::getBamType(generator->module()), 0);
+  auto size_type =
+      llvm::Type::getIntNTy(llvm::getGlobalContext(), sizeof(size_t) * 8);
+  auto outer =
+      llvm::cast<llvm::Function>(generator->module()->getOrInsertFunction(
+          name,
+          llvm::Type::getVoidTy(llvm::getGlobalContext()),
+          llvm::PointerType::get(bamql::getBamHeaderType(generator->module()),
+                                 0),
+          llvm::PointerType::get(read_type, 0),
+          size_type,
+          llvm::Type::getInt8PtrTy(llvm::getGlobalContext()),
+          nullptr));
+  // The working space for a batch is on the stack, so the exported function
+  // hands the reads to the real one in chunks of a fixed size, whatever size
+  // of batch the caller chooses.
+  auto func = llvm::Function::Create(outer->getFunctionType(),
+                                     llvm::GlobalValue::InternalLinkage,
+                                     name + ".chunk",
+                                     generator->module());
+  {
+    auto outer_entry =
+        llvm::BasicBlock::Create(llvm::getGlobalContext(), "entry", outer);
+    auto outer_loop =
+        llvm::BasicBlock::Create(llvm::getGlobalContext(), "loop", outer);
+    auto outer_exit =
+        llvm::BasicBlock::Create(llvm::getGlobalContext(), "exit", outer);
+    llvm::IRBuilder<> builder(outer_entry);
+    auto args = outer->arg_begin();
+    auto header_value = args++;
+    header_value->setName("header");
+    auto reads_value = args++;
+    reads_value->setName("reads");
+    auto count_value = args++;
+    count_value->setName("count");
+    auto out_value = args++;
+    out_value->setName("out");
+    auto zero = llvm::ConstantInt::get(size_type, 0);
+    auto chunk_size =
+        llvm::ConstantInt::get(size_type, VectorColumns::MAX_BATCH);
+    builder.CreateCondBr(
+        builder.CreateICmpEQ(count_value, zero), outer_exit, outer_loop);
+
+    builder.SetInsertPoint(outer_loop);
+    auto offset = builder.CreatePHI(size_type, 2);
+    offset->addIncoming(zero, outer_entry);
+    auto remaining = builder.CreateSub(count_value, offset);
+    auto chunk = builder.CreateSelect(
+        builder.CreateICmpULT(remaining, chunk_size), remaining, chunk_size);
+    builder.CreateCall4(func,
+                        header_value,
+                        builder.CreateGEP(reads_value, offset),
+                        chunk,
+                        builder.CreateGEP(out_value, offset));
+    auto next = builder.CreateAdd(offset, chunk);
+    offset->addIncoming(next, outer_loop);
+    builder.CreateCondBr(
+        builder.CreateICmpULT(next, count_value), outer_loop, outer_exit);
+
+    builder.SetInsertPoint(outer_exit);
+    builder.CreateRetVoid();
+  }
+
+  auto entry =
+      llvm::BasicBlock::Create(llvm::getGlobalContext(), "entry", func);
+  auto start =
+      llvm::BasicBlock::Create(llvm::getGlobalContext(), "start", func);
+  auto loop = llvm::BasicBlock::Create(llvm::getGlobalContext(), "loop", func);
+  auto exit = llvm::BasicBlock::Create(llvm::getGlobalContext(), "exit", func);
+  GenerateState state(generator, entry);
+  auto args = func->arg_begin();
+  auto header_value = args++;
+  header_value->setName("header");
+  auto reads_value = args++;
+  reads_value->setName("reads");
+  auto count_value = args++;
+  count_value->setName("count");
+  auto out_value = args++;
+  out_value->setName("out");
+
+  auto zero = llvm::ConstantInt::get(size_type, 0);
+  auto byte_type = llvm::Type::getInt8Ty(llvm::getGlobalContext());
+  state->CreateCondBr(state->CreateICmpEQ(count_value, zero), exit, start);
+  state->SetInsertPoint(start);
+
+  // If some, or all, of the query only uses the fixed fields of the reads,
+  // evaluate that part over many reads at once to produce a selection of the
+  // reads that need to be checked individually. When profiling, every read
+  // must go through the scalar code to be counted.
+  bool exact = this->isVectorisable();
+  llvm::Value *selection = nullptr;
+  if (state.profile() == nullptr && (exact || this->hasVectorGuard())) {
+    auto vector_loop =
+        llvm::BasicBlock::Create(llvm::getGlobalContext(), "vector", func);
+    auto vector_done =
+        llvm::BasicBlock::Create(llvm::getGlobalContext(), "vector_done", func);
+    auto width = llvm::ConstantInt::get(size_type, VectorColumns::WIDTH);
+    auto padded = state->CreateAnd(
+        state->CreateAdd(count_value,
+                         llvm::ConstantInt::get(size_type,
+                                                VectorColumns::WIDTH - 1)),
+        llvm::ConstantInt::getSigned(size_type,
+                                     -(int64_t)VectorColumns::WIDTH));
+    // At most `MAX_BATCH` reads are passed in, so the selection can be a
+    // fixed size and allocated once, in the entry block.
+    llvm::IRBuilder<> alloca_builder(entry, entry->begin());
+    auto selection_alloca = alloca_builder.CreateAlloca(
+        byte_type,
+        llvm::ConstantInt::get(size_type, VectorColumns::MAX_BATCH),
+        "selection");
+    // The selection is written a vector at a time.
+    selection_alloca->setAlignment(16);
+    selection = selection_alloca;
+    auto gather_point = state->CreateBr(vector_loop);
+    auto vector_entry = state->GetInsertBlock();
+
+    state->SetInsertPoint(vector_loop);
+    auto lane = state->CreatePHI(size_type, 2);
+    lane->addIncoming(zero, vector_entry);
+    VectorColumns columns(
+        header_value, reads_value, count_value, lane, gather_point);
+    auto result = exact ? this->generateVector(state, columns)
+                        : this->generateVectorGuard(state, columns);
+    auto vector_type = llvm::VectorType::get(byte_type, VectorColumns::WIDTH);
+    state->CreateStore(
+        state->CreateZExt(result, vector_type),
+        state->CreateBitCast(state->CreateGEP(selection, lane),
+                             llvm::PointerType::get(vector_type, 0)));
+    auto next_lane = state->CreateAdd(lane, width);
+    lane->addIncoming(next_lane, state->GetInsertBlock());
+    state->CreateCondBr(
+        state->CreateICmpULT(next_lane, padded), vector_loop, vector_done);
+    state->SetInsertPoint(vector_done);
+
+    if (exact) {
+      state->CreateMemCpy(out_value, selection, count_value, 1);
+      state->CreateBr(exit);
+      state->SetInsertPoint(exit);
+      state->CreateRetVoid();
+      loop->eraseFromParent();
+      return outer;
+    }
+  }
+  auto loop_entry = state->GetInsertBlock();
+  state->CreateBr(loop);
+
+  // The query is generated inline in the loop, rather than calling the filter
+  // function, so there is no call overhead per read.
+  state->SetInsertPoint(loop);
+  auto index = state->CreatePHI(size_type, 2);
+  index->addIncoming(zero, loop_entry);
+  llvm::BasicBlock *latch = nullptr;
+  if (selection != nullptr) {
+    auto eval =
+        llvm::BasicBlock::Create(llvm::getGlobalContext(), "eval", func);
+    latch = llvm::BasicBlock::Create(llvm::getGlobalContext(), "latch", func);
+    auto selected = state->CreateICmpNE(
+        state->CreateLoad(state->CreateGEP(selection, index)),
+        llvm::ConstantInt::get(byte_type, 0));
+    state->CreateCondBr(selected, eval, latch);
+    state->SetInsertPoint(eval);
+  }
+  auto read = state->CreateLoad(state->CreateGEP(reads_value, index));
+  state.startRead(read);
+  this->writeDebug(state);
+  llvm::Value *result = this->generate(state, read, header_value);
+  if (selection != nullptr) {
+    state->CreateBr(latch);
+    auto eval_end = state->GetInsertBlock();
+    state->SetInsertPoint(latch);
+    auto phi =
+        state->CreatePHI(llvm::Type::getInt1Ty(llvm::getGlobalContext()), 2);
+    phi->addIncoming(llvm::ConstantInt::getFalse(llvm::getGlobalContext()),
+                     loop);
+    phi->addIncoming(result, eval_end);
+    result = phi;
+  }
+  state->CreateStore(state->CreateZExt(result, byte_type),
+                     state->CreateGEP(out_value, index));
+  auto next = state->CreateAdd(index, llvm::ConstantInt::get(size_type, 1));
+  index->addIncoming(next, state->GetInsertBlock());
+  state->CreateCondBr(state->CreateICmpEQ(next, count_value), exit, loop);
+
+  state->SetInsertPoint(exit);
+  state->CreateRetVoid();
+  return outer;
+}
+
+bool AstNode::isVectorisable() { return false; }
+
+bool AstNode::hasVectorGuard() { return isVectorisable(); }
+
+llvm::Value *AstNode::generateVector(GenerateState &state,
+                                     VectorColumns &columns) {
+  return nullptr;
+}
+
+llvm::Value *AstNode::generateVectorGuard(GenerateState &state,
+                                          VectorColumns &columns) {
+  return generateVector(state, columns);
+}
+
+unsigned int AstNode::cost() { return 4; }
+
+bool AstNode::hasSideEffects() { return false; }
+
+void AstNode::optimise(const Profile *profile) {}
+
+std::string AstNode::key() { return std::string(); }
+
+void AstNode::forEachChild(
+    const std::function<void(std::shared_ptr<AstNode> &)> &function) {}
+
+std::shared_ptr<AstNode> AstNode::simplified() {
+  forEachChild(simplify);
+  return nullptr;
+}
+
+bool AstNode::constantValue(bool &value) { return false; }
+
+bool AstNode::flagTest(uint16_t &mask, uint16_t &value, bool &negated) {
+  return false;
+}
+
+bool AstNode::nucleotideTest(
+    std::vector<std::pair<int32_t, unsigned char>> &sites, bool &exact) {
+  return false;
+}
+
+bool AstNode::positionRanges(bam_hdr_t *header,
+                             uint32_t tid,
+                             PositionRanges &ranges) {
+  return false;
+}
+
+bool AstNode::regionTest(RegionMap &regions) { return false; }
+
+std::shared_ptr<AstNode> AstNode::negate() { return nullptr; }
+
 DebuggableNode::DebuggableNode(ParseState &state)
     : line(state.currentLine()), column(state.currentColumn()) {}
 void DebuggableNode::writeDebug(GenerateState &state) {
@@ -86,12 +348,10 @@ void DebuggableNode::writeDebug(GenerateState &state) {
 }
 
 llvm::Type *getRuntimeType(llvm::Module *module, llvm::StringRef name) {
-  auto struct_ty = module->getTypeByName(name);
-  if (struct_ty == nullptr) {
-    define_runtime(module);
-    struct_ty = module->getTypeByName(name);
-  }
-  return struct_ty;
+  // Named types belong to the context, so once the runtime has been loaded,
+  // its types are available to every module.
+  getRuntimeModule();
+  return module->getTypeByName(name);
 }
 
 llvm::Type *getBamType(llvm::Module *module) {
@@ -102,11 +362,16 @@ llvm::Type *getBamHeaderType(llvm::Module *module) {
   return getRuntimeType(module, "struct.bam_hdr_t");
 }
 
-Generator::Generator(llvm::Module *module, llvm::DIScope *debug_scope_)
-    : mod(module), debug_scope(debug_scope_) {}
+Generator::Generator(llvm::Module *module,
+                     llvm::DIScope *debug_scope_,
+                     std::shared_ptr<Profile> profile)
+    : mod(module), debug_scope(debug_scope_), prof(profile) {
+  declareRuntime(module);
+}
 
 llvm::Module *Generator::module() const { return mod; }
 llvm::DIScope *Generator::debugScope() const { return debug_scope; }
+Profile *Generator::profile() const { return prof.get(); }
 
 llvm::Value *Generator::createString(std::string &str) {
   auto iterator = constant_pool.find(str);
@@ -136,16 +401,228 @@ llvm::Value *Generator::createString(std::string &str) {
   return result;
 }
 
+llvm::Value *Generator::createArray(llvm::Constant *array) {
+  // Constants are uniqued, so identical arrays are the same object.
+  auto iterator = array_pool.find(array);
+  if (iterator != array_pool.end()) {
+    return iterator->second;
+  }
+
+  auto global_variable = new llvm::GlobalVariable(
+      *mod, array->getType(), true, llvm::GlobalValue::PrivateLinkage, array);
+  auto zero = llvm::ConstantInt::get(
+      llvm::Type::getInt32Ty(llvm::getGlobalContext()), 0);
+  std::vector<llvm::Value *> indicies;
+  indicies.push_back(zero);
+  indicies.push_back(zero);
+  auto result = llvm::ConstantExpr::getGetElementPtr(global_variable, indicies);
+  array_pool[array] = result;
+  return result;
+}
+
 GenerateState::GenerateState(std::shared_ptr<Generator> &generator_,
                              llvm::BasicBlock *entry)
-    : generator(generator_), builder(entry) {}
+    : generator(generator_), builder(entry), read_block(nullptr),
+      read_value(nullptr), aux_values(nullptr),
+      read_context(nullptr) {}
 
 llvm::IRBuilder<> *GenerateState::operator->() { return &builder; }
 llvm::Module *GenerateState::module() const { return generator->module(); }
 llvm::DIScope *GenerateState::debugScope() const {
   return generator->debugScope();
 }
+Profile *GenerateState::profile() const { return generator->profile(); }
+void GenerateState::startRead(llvm::Value *read) {
+  read_block = llvm::BasicBlock::Create(
+      llvm::getGlobalContext(), "read", builder.GetInsertBlock()->getParent());
+  builder.CreateBr(read_block);
+  builder.SetInsertPoint(read_block);
+  read_value = read;
+  memo.clear();
+  aux_tags.clear();
+  aux_values = nullptr;
+  aux_lookups.clear();
+  read_context = nullptr;
+}
+llvm::Value *GenerateState::memoSlot(AstNode *node) {
+  if (read_block == nullptr) {
+    return nullptr;
+  }
+  auto it = memo.find(node);
+  if (it != memo.end()) {
+    return it->second;
+  }
+  // The variable lives in the entry block, so that it can be promoted to a
+  // register, but is cleared at the start of every read.
+  auto byte_type = llvm::Type::getInt8Ty(llvm::getGlobalContext());
+  auto &entry = read_block->getParent()->getEntryBlock();
+  llvm::IRBuilder<> alloca_builder(&entry, entry.begin());
+  auto slot = alloca_builder.CreateAlloca(byte_type, nullptr, "memo");
+  llvm::IRBuilder<> reset_builder(read_block,
+                                  read_block->getFirstInsertionPt());
+  reset_builder.CreateStore(llvm::ConstantInt::get(byte_type, 0), slot);
+  memo[node] = slot;
+  return slot;
+}
+llvm::Value *GenerateState::auxTag(llvm::Value *read,
+                                   char group1,
+                                   char group2) {
+  auto byte_type = llvm::Type::getInt8Ty(llvm::getGlobalContext());
+  if (read_block == nullptr || read != read_value) {
+    return builder.CreateCall3(
+        module()->getFunction("bamql_aux_get"),
+        read,
+        llvm::ConstantInt::get(byte_type, group1),
+        llvm::ConstantInt::get(byte_type, group2));
+  }
+  llvm::Value *tags_arg = nullptr;
+  llvm::Value *count_arg = nullptr;
+  if (!aux_lookups.empty()) {
+    tags_arg = aux_lookups.front()->getArgOperand(2);
+    count_arg = aux_lookups.front()->getArgOperand(3);
+  }
+  size_t index;
+  for (index = 0; index < aux_tags.length() / 2; index++) {
+    if (aux_tags[2 * index] == group1 && aux_tags[2 * index + 1] == group2) {
+      break;
+    }
+  }
+  if (index == aux_tags.length() / 2) {
+    // A new tag is needed, so grow the list of tags searched for by every
+    // lookup. Existing tags keep their positions. Whichever lookup runs first
+    // for a read finds them all.
+    aux_tags.push_back(group1);
+    aux_tags.push_back(group2);
+    auto tags_type = llvm::ArrayType::get(byte_type, aux_tags.length());
+    auto tags = new llvm::GlobalVariable(
+        *module(),
+        tags_type,
+        true,
+        llvm::GlobalValue::PrivateLinkage,
+        llvm::ConstantDataArray::getString(
+            llvm::getGlobalContext(), aux_tags, false),
+        ".aux_tags");
+    auto tags_ptr = llvm::ConstantExpr::getPointerCast(
+        tags, llvm::Type::getInt8PtrTy(llvm::getGlobalContext()));
+    auto count = llvm::ConstantInt::get(
+        llvm::Type::getInt32Ty(llvm::getGlobalContext()), index + 1);
+    tags_arg = tags_ptr;
+    count_arg = count;
+    if (aux_values == nullptr) {
+      auto &entry = read_block->getParent()->getEntryBlock();
+      llvm::IRBuilder<> alloca_builder(&entry, entry.begin());
+      aux_values = alloca_builder.CreateAlloca(
+          llvm::Type::getInt8PtrTy(llvm::getGlobalContext()), count, "aux");
+    } else {
+      auto old_tags = llvm::cast<llvm::GlobalVariable>(
+          aux_lookups.front()->getArgOperand(2)->stripPointerCasts());
+      aux_values->setOperand(0, count);
+      for (auto it = aux_lookups.begin(); it != aux_lookups.end(); it++) {
+        (*it)->setArgOperand(2, tags_ptr);
+        (*it)->setArgOperand(3, count);
+      }
+      old_tags->removeDeadConstantUsers();
+      old_tags->eraseFromParent();
+    }
+  }
+  std::vector<llvm::Value *> args;
+  args.push_back(read_value);
+  args.push_back(readContext());
+  args.push_back(tags_arg);
+  args.push_back(count_arg);
+  args.push_back(aux_values);
+  args.push_back(llvm::ConstantInt::get(
+      llvm::Type::getInt32Ty(llvm::getGlobalContext()), index));
+  auto lookup =
+      builder.CreateCall(module()->getFunction("bamql_aux_lookup"), args);
+  aux_lookups.push_back(lookup);
+  return lookup;
+}
+llvm::Value *GenerateState::readContext() {
+  if (read_context != nullptr) {
+    return read_context;
+  }
+  // Like the memoised results, the context lives in the entry block and is
+  // marked empty at the start of every read. Outside of a read, it is only
+  // good for the current use.
+  auto &entry = builder.GetInsertBlock()->getParent()->getEntryBlock();
+  llvm::IRBuilder<> alloca_builder(&entry, entry.begin());
+  auto context = alloca_builder.CreateAlloca(
+      getRuntimeType(module(), "struct.bamql_read_context"),
+      nullptr,
+      "context");
+  llvm::IRBuilder<> reset_builder(builder.GetInsertBlock(),
+                                  builder.GetInsertPoint());
+  if (read_block != nullptr) {
+    reset_builder.SetInsertPoint(read_block,
+                                 read_block->getFirstInsertionPt());
+    read_context = context;
+  }
+  reset_builder.CreateStore(
+      llvm::ConstantInt::get(llvm::Type::getInt32Ty(llvm::getGlobalContext()),
+                             0),
+      reset_builder.CreateConstGEP2_32(context, 0, 0));
+  return context;
+}
 llvm::Value *GenerateState::createString(std::string &str) {
   return generator->createString(str);
 }
+
+llvm::Value *GenerateState::createArray(llvm::Constant *array) {
+  return generator->createArray(array);
+}
+
+std::string getHostCPUFeatures() {
+  llvm::StringMap<bool> features;
+  std::string result;
+  if (!llvm::sys::getHostCPUFeatures(features)) {
+    return result;
+  }
+  for (auto it = features.begin(); it != features.end(); it++) {
+    if (result.length() > 0) {
+      result.push_back(',');
+    }
+    result.push_back(it->getValue() ? '+' : '-');
+    result.append(it->getKey().str());
+  }
+  return result;
+}
+
+void normaliseRanges(PositionRanges &ranges) {
+  std::sort(ranges.begin(), ranges.end());
+  size_t output = 0;
+  for (size_t it = 0; it < ranges.size(); it++) {
+    // Merge ranges that overlap or touch (i.e., `[a, b]` and `[b + 1, c]`).
+    // The end may be INT32_MAX, so add in 64 bits.
+    if (output > 0 &&
+        ranges[it].first <= (int64_t)ranges[output - 1].second + 1) {
+      ranges[output - 1].second =
+          std::max(ranges[output - 1].second, ranges[it].second);
+    } else {
+      ranges[output++] = ranges[it];
+    }
+  }
+  ranges.resize(output);
+}
+
+PositionRanges intersectRanges(const PositionRanges &a,
+                               const PositionRanges &b) {
+  PositionRanges result;
+  auto a_it = a.begin();
+  auto b_it = b.begin();
+  while (a_it != a.end() && b_it != b.end()) {
+    auto start = std::max(a_it->first, b_it->first);
+    auto end = std::min(a_it->second, b_it->second);
+    if (start <= end) {
+      result.push_back(std::make_pair(start, end));
+    }
+    // Whichever range ends first can't overlap anything else.
+    if (a_it->second < b_it->second) {
+      a_it++;
+    } else {
+      b_it++;
+    }
+  }
+  return result;
+}
 }
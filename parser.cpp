@@ -134,6 +134,9 @@ std::shared_ptr<AstNode> AstNode::parse(
   if (!state.empty()) {
     throw ParseError(state.where(), "Junk at end of input.");
   }
+  simplify(node);
+  node->optimise(nullptr);
+  shareCommonSubexpressions(node);
   return node;
 }
 
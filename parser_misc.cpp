@@ -151,6 +151,20 @@ unsigned char ParseState::parseNucleotide() {
   }
   return 0;
 }
+std::string ParseState::parsePath() throw(ParseError) {
+  if (index >= input.length() || input[index] != '"') {
+    return parseStr(" \t\r\n,)", true);
+  }
+  auto start = index++;
+  while (index < input.length() && input[index] != '"') {
+    index++;
+  }
+  if (index == input.length()) {
+    throw ParseError(start, "Unterminated file name.");
+  }
+  index++;
+  return input.substr(start + 1, index - start - 2);
+}
 std::string ParseState::strFrom(size_t start) const {
   return input.substr(start, index - start);
 }
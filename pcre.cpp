@@ -1,7 +1,169 @@
+#include <cctype>
 #include <pcre.h>
 #include "bamql.hpp"
+#include "runtime.h"
 
-bamql::RegularExpression bamql::ParseState::parseRegEx() throw(ParseError) {
+/**
+ * Find the end of a character class, given the index of the opening bracket.
+ */
+static size_t skipClass(const std::string &pattern, size_t index) {
+  index++;
+  if (index < pattern.length() && pattern[index] == '^') {
+    index++;
+  }
+  if (index < pattern.length() && pattern[index] == ']') {
+    index++;
+  }
+  while (index < pattern.length() && pattern[index] != ']') {
+    if (pattern[index] == '\\') {
+      index++;
+    } else if (pattern[index] == '[' && index + 1 < pattern.length() &&
+               pattern[index + 1] == ':') {
+      auto end = pattern.find(":]", index + 2);
+      if (end != std::string::npos) {
+        index = end + 1;
+      }
+    }
+    index++;
+  }
+  return index;
+}
+
+/**
+ * Determine if there is a counted repetition (e.g., `{2,5}`) at the index.
+ * Otherwise, PCRE treats the brace as a literal.
+ */
+static bool isCountedRepeat(const std::string &pattern, size_t index) {
+  if (index >= pattern.length() || pattern[index] != '{') {
+    return false;
+  }
+  index++;
+  auto start = index;
+  while (index < pattern.length() && isdigit(pattern[index])) {
+    index++;
+  }
+  if (index == start) {
+    return false;
+  }
+  if (index < pattern.length() && pattern[index] == ',') {
+    index++;
+    while (index < pattern.length() && isdigit(pattern[index])) {
+      index++;
+    }
+  }
+  return index < pattern.length() && pattern[index] == '}';
+}
+
+/**
+ * Find the longest run of literal characters that must be present in any
+ * string matched by the pattern.
+ *
+ * Only the top level of the expression is examined; groups and classes simply
+ * break the run. If the pattern contains alternation, option settings, or
+ * escapes that aren't understood, no literal is returned, so the result is
+ * always safe to use as a prefilter.
+ */
+static std::string findRequiredLiteral(const std::string &pattern) {
+  std::string best;
+  std::string current;
+  size_t index = 0;
+  while (index < pattern.length()) {
+    bool is_literal = false;
+    char literal = '\0';
+    switch (pattern[index]) {
+    case '|':
+      return std::string();
+    case '(': {
+      if (index + 1 < pattern.length() && pattern[index + 1] == '?') {
+        return std::string();
+      }
+      int depth = 0;
+      do {
+        if (pattern[index] == '\\') {
+          index++;
+        } else if (pattern[index] == '[') {
+          index = skipClass(pattern, index);
+        } else if (pattern[index] == '(') {
+          depth++;
+        } else if (pattern[index] == ')') {
+          depth--;
+        }
+        index++;
+      } while (depth > 0 && index < pattern.length());
+      break;
+    }
+    case '[':
+      index = skipClass(pattern, index) + 1;
+      break;
+    case '.':
+    case '^':
+    case '$':
+      index++;
+      break;
+    case '\\':
+      if (index + 1 >= pattern.length()) {
+        return std::string();
+      }
+      if (isalnum(pattern[index + 1])) {
+        // Character type escapes match something, but not a literal. Anything
+        // else (hex codes, back references, \Q) may consume more of the
+        // pattern, so give up.
+        if (std::string("dDwWsShHvVRNXCbBAZzG").find(pattern[index + 1]) ==
+            std::string::npos) {
+          return std::string();
+        }
+      } else {
+        is_literal = true;
+        literal = pattern[index + 1];
+      }
+      index += 2;
+      break;
+    case '*':
+    case '+':
+    case '?':
+    case ')':
+      return std::string();
+    default:
+      is_literal = true;
+      literal = pattern[index];
+      index++;
+      break;
+    }
+
+    // Check for a quantifier after this item. If the item can be absent, it
+    // can't contribute to the literal.
+    bool optional = false;
+    bool repeated = false;
+    if (index < pattern.length()) {
+      if (pattern[index] == '?' || pattern[index] == '*') {
+        optional = true;
+        index++;
+      } else if (pattern[index] == '+') {
+        repeated = true;
+        index++;
+      } else if (isCountedRepeat(pattern, index)) {
+        optional = true;
+        index = pattern.find('}', index) + 1;
+      }
+      if ((optional || repeated) && index < pattern.length() &&
+          (pattern[index] == '?' || pattern[index] == '+')) {
+        index++;
+      }
+    }
+    if (is_literal && !optional) {
+      current.push_back(literal);
+    }
+    if (!is_literal || optional || repeated) {
+      if (current.length() > best.length()) {
+        best = current;
+      }
+      current.clear();
+    }
+  }
+  return current.length() > best.length() ? current : best;
+}
+
+bamql::ParsedRegEx bamql::ParseState::parseRegEx() throw(ParseError) {
   auto start = index;
   index++;
   while (index < input.length() && input[index] != input[start]) {
@@ -12,14 +174,12 @@ bamql::RegularExpression bamql::ParseState::parseRegEx() throw(ParseError) {
   }
   index++;
 
+  auto pattern = input.substr(start + 1, index - start - 2);
   int erroroffset;
   const char *error;
   std::shared_ptr<pcre> regex(
-      pcre_compile(input.substr(start + 1, index - start - 2).c_str(),
-                   PCRE_NO_AUTO_CAPTURE,
-                   &error,
-                   &erroroffset,
-                   nullptr),
+      pcre_compile(
+          pattern.c_str(), PCRE_NO_AUTO_CAPTURE, &error, &erroroffset, nullptr),
       pcre_free);
   if (!regex) {
     throw ParseError(start + erroroffset, std::string(error));
@@ -30,9 +190,10 @@ bamql::RegularExpression bamql::ParseState::parseRegEx() throw(ParseError) {
     throw ParseError(start, "Internal PCRE error.");
   }
 
-  return [regex, size](GenerateState &generate) {
-    int erroroffset;
-    const char *error = nullptr;
+  ParsedRegEx result;
+  result.literal = findRequiredLiteral(pattern);
+  result.compiled.assign((uint8_t *)regex.get(), (uint8_t *)regex.get() + size);
+  result.generate = [regex, size](GenerateState &generate) {
     auto array = llvm::ConstantDataArray::get(
         llvm::getGlobalContext(),
         llvm::ArrayRef<uint8_t>((uint8_t *)regex.get(), size));
@@ -53,4 +214,23 @@ bamql::RegularExpression bamql::ParseState::parseRegEx() throw(ParseError) {
     indicies.push_back(zero);
     return llvm::ConstantExpr::getGetElementPtr(global_variable, indicies);
   };
+  return result;
+}
+
+bool bamql::ParsedRegEx::match(const char *input, size_t length) const {
+  return bamql_re_match((const char *)compiled.data(),
+                        literal.c_str(),
+                        literal.length(),
+                        input,
+                        length);
+}
+
+std::string bamql::ParsedRegEx::key() const {
+  static const char digits[] = "0123456789abcdef";
+  std::string result;
+  for (auto it = compiled.begin(); it != compiled.end(); it++) {
+    result.push_back(digits[*it >> 4]);
+    result.push_back(digits[*it & 0xF]);
+  }
+  return result;
 }
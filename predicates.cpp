@@ -15,13 +15,20 @@
  */
 
 #include <cstdint>
+#include <iomanip>
+#include <sstream>
 #include <htslib/sam.h>
 #include "bamql.hpp"
 #include "boolean_constant.hpp"
 #include "check_aux.hpp"
 #include "check_chromosome.hpp"
+#include "check_composition.hpp"
 #include "check_flag.hpp"
 #include "check_nt.hpp"
+#include "check_region.hpp"
+#include "check_set.hpp"
+#include "check_variant.hpp"
+#include "runtime.h"
 
 // Please keep the predicates in alphabetical order.
 namespace bamql {
@@ -51,8 +58,31 @@ public:
         function,
         read,
         llvm::ConstantInt::get(llvm::Type::getInt8Ty(llvm::getGlobalContext()),
-                               -10 * log(probability)));
+                               quality()));
   }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_mapping_quality(read, quality());
+  }
+  bool isVectorisable() { return true; }
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns) {
+    auto quality = columns.load(state, "bamql_gather_quality");
+    return state->CreateAnd(
+        state->CreateICmpNE(
+            quality,
+            VectorColumns::splat(llvm::ConstantInt::get(
+                llvm::Type::getInt8Ty(llvm::getGlobalContext()), 255))),
+        state->CreateICmpUGE(
+            quality,
+            VectorColumns::splat(llvm::ConstantInt::get(
+                llvm::Type::getInt8Ty(llvm::getGlobalContext()),
+                quality()))));
+  }
+  std::string key() {
+    // Probabilities that give the same quality are the same check.
+    return "mapping_quality(" + std::to_string(quality()) + ")";
+  }
+  unsigned int cost() { return 1; }
 
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('(');
@@ -69,25 +99,49 @@ public:
   }
 
 private:
+  /**
+   * The minimum mapping quality, on the Phred scale, that is compiled.
+   */
+  uint8_t quality() const {
+    return (uint8_t)(uint64_t)(-10 * log(probability));
+  }
+
   double probability;
 };
 
 /**
- * A predicate that randomly is true.
+ * A predicate that is true for a pseudo-random selection of reads. The choice
+ * depends only on the read name and the seed, so it is reproducible and both
+ * mates are chosen together.
  */
 class RandomlyNode : public DebuggableNode {
 public:
-  RandomlyNode(double probability_, ParseState &state)
-      : DebuggableNode(state), probability(probability_) {}
+  RandomlyNode(double probability_, uint32_t seed_, ParseState &state)
+      : DebuggableNode(state), probability(probability_), seed(seed_) {}
   virtual llvm::Value *generate(GenerateState &state,
                                 llvm::Value *read,
                                 llvm::Value *header) {
     auto function = state.module()->getFunction("randomly");
-    return state->CreateCall(
+    return state->CreateCall3(
         function,
+        read,
         llvm::ConstantFP::get(llvm::Type::getDoubleTy(llvm::getGlobalContext()),
-                              probability));
+                              probability),
+        llvm::ConstantInt::get(llvm::Type::getInt32Ty(llvm::getGlobalContext()),
+                               seed));
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return randomly(read, probability, seed);
   }
+  std::string key() {
+    // Every digit matters, or different probabilities could be shared.
+    std::ostringstream key;
+    key << std::setprecision(17) << "random(" << probability << "," << seed
+        << ")";
+    return key.str();
+  }
+  unsigned int cost() { return 2; }
 
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('(');
@@ -97,14 +151,22 @@ public:
       throw ParseError(state.where(),
                        "The provided probability is not probable.");
     }
+    int seed = 0;
+    state.parseSpace();
+    if (!state.empty() && *state == ',') {
+      state.next();
+      state.parseSpace();
+      seed = state.parseInt();
+    }
 
     state.parseCharInSpace(')');
 
-    return std::make_shared<RandomlyNode>(probability, state);
+    return std::make_shared<RandomlyNode>(probability, seed, state);
   }
 
 private:
   double probability;
+  uint32_t seed;
 };
 
 /**
@@ -124,6 +186,29 @@ public:
         llvm::ConstantInt::get(llvm::Type::getInt16Ty(llvm::getGlobalContext()),
                                raw));
   }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_flag(read, raw);
+  }
+  bool isVectorisable() { return true; }
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns) {
+    auto mask = VectorColumns::splat(llvm::ConstantInt::get(
+        llvm::Type::getInt16Ty(llvm::getGlobalContext()), raw));
+    return state->CreateICmpEQ(
+        state->CreateAnd(columns.load(state, "bamql_gather_flag"), mask),
+        mask);
+  }
+  std::string key() { return "flag(" + std::to_string(raw) + ")"; }
+  unsigned int cost() { return 1; }
+  bool flagTest(uint16_t &mask, uint16_t &value, bool &negated) {
+    mask = raw;
+    value = raw;
+    negated = false;
+    return true;
+  }
+  std::shared_ptr<AstNode> negate() {
+    return std::make_shared<FlagMaskNode>(raw, raw, true);
+  }
 
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('(');
@@ -147,15 +232,55 @@ public:
                                 llvm::Value *read,
                                 llvm::Value *header) {
     auto function = state.module()->getFunction("check_position");
-    return state->CreateCall4(
+    return state->CreateCall5(
         function,
         header,
         read,
+        state.readContext(),
         llvm::ConstantInt::get(llvm::Type::getInt32Ty(llvm::getGlobalContext()),
                                start),
         llvm::ConstantInt::get(llvm::Type::getInt32Ty(llvm::getGlobalContext()),
                                end));
   }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_position(header, read, context, start, end);
+  }
+  bool isVectorisable() { return true; }
+  llvm::Value *generateVector(GenerateState &state, VectorColumns &columns) {
+    auto mapped_start = columns.load(state, "bamql_gather_start");
+    auto mapped_end = columns.load(state, "bamql_gather_end");
+    auto start_value = VectorColumns::splat(llvm::ConstantInt::get(
+        llvm::Type::getInt32Ty(llvm::getGlobalContext()), start));
+    auto end_value = VectorColumns::splat(llvm::ConstantInt::get(
+        llvm::Type::getInt32Ty(llvm::getGlobalContext()), end));
+    auto overlaps = state->CreateOr(
+        state->CreateOr(
+            state->CreateAnd(
+                state->CreateICmpULE(mapped_start, start_value),
+                state->CreateICmpUGE(mapped_end, start_value)),
+            state->CreateAnd(state->CreateICmpULE(mapped_start, end_value),
+                             state->CreateICmpUGE(mapped_end, end_value))),
+        state->CreateAnd(state->CreateICmpUGE(mapped_start, start_value),
+                         state->CreateICmpULE(mapped_end, end_value)));
+    return state->CreateAnd(
+        state->CreateICmpSLT(columns.load(state, "bamql_gather_tid"),
+                             columns.targetCount(state)),
+        overlaps);
+  }
+  std::string key() {
+    return "position(" + std::to_string(start) + "," + std::to_string(end) +
+           ")";
+  }
+  unsigned int cost() { return 3; }
+  bool positionRanges(bam_hdr_t *header, uint32_t tid, PositionRanges &ranges) {
+    ranges.push_back(std::make_pair(start, end));
+    return true;
+  }
+  bool regionTest(RegionMap &regions) {
+    regions[""].push_back(std::make_pair(start, end));
+    return true;
+  }
 
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('(');
@@ -197,6 +322,12 @@ public:
     auto function = state.module()->getFunction("check_split_pair");
     return state->CreateCall2(function, header, read);
   }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return check_split_pair(header, read);
+  }
+  std::string key() { return "split_pair"; }
+  unsigned int cost() { return 2; }
 
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     return std::make_shared<SplitPairNode>(state);
@@ -205,14 +336,27 @@ public:
 
 class HeaderRegExNode : public DebuggableNode {
 public:
-  HeaderRegExNode(ParseState &state, RegularExpression &regex_)
+  HeaderRegExNode(ParseState &state, ParsedRegEx &regex_)
       : DebuggableNode(state), regex(regex_) {}
   virtual llvm::Value *generate(GenerateState &state,
                                 llvm::Value *read,
                                 llvm::Value *header) {
     auto function = state.module()->getFunction("header_regex");
-    return state->CreateCall2(function, regex(state), read);
+    auto &literal = regex.literal;
+    return state->CreateCall4(
+        function,
+        regex(state),
+        state.createString(literal),
+        llvm::ConstantInt::get(llvm::Type::getInt64Ty(llvm::getGlobalContext()),
+                               literal.length()),
+        read);
+  }
+  bool isInterpretable() { return true; }
+  bool evaluate(bam_hdr_t *header, bam1_t *read, bamql_read_context *context) {
+    return regex.match(bam_get_qname(read), read->core.l_qname - 1);
   }
+  std::string key() { return "header(" + regex.key() + ")"; }
+  unsigned int cost() { return 6; }
 
   static std::shared_ptr<AstNode> parse(ParseState &state) throw(ParseError) {
     state.parseCharInSpace('~');
@@ -221,7 +365,7 @@ public:
   }
 
 private:
-  RegularExpression regex;
+  ParsedRegEx regex;
 };
 
 /**
@@ -231,12 +375,13 @@ PredicateMap getDefaultPredicates() {
 
   return {
     // Auxiliary data
-    { std::string("read_group"),
-      CheckAuxStringNode<'R', 'G', readGroupChar>::parse },
-    { std::string("aux_str"), CheckAuxUserStringNode::parse },
     { std::string("aux_char"), CheckAuxUserCharNode::parse },
-    { std::string("aux_int"), CheckAuxUserIntNode::parse },
     { std::string("aux_dbl"), CheckAuxUserFloatNode::parse },
+    { std::string("aux_in"), AuxSetNode::parse },
+    { std::string("aux_int"), CheckAuxUserIntNode::parse },
+    { std::string("aux_str"), CheckAuxUserStringNode::parse },
+    { std::string("read_group"),
+      CheckAuxStringNode<'R', 'G', readGroupChar>::parse },
 
     // Chromosome information
     { std::string("chr"), CheckChromosomeNode<false>::parse },
@@ -268,15 +413,26 @@ PredicateMap getDefaultPredicates() {
     { std::string("after"), PositionNode::parseAfter },
     { std::string("before"), PositionNode::parseBefore },
     { std::string("position"), PositionNode::parse },
+    { std::string("region"), RegionNode::parse },
 
     // Miscellaneous
-    { std::string("mapping_quality"), MappingQualityNode::parse },
+    { std::string("alt_allele"), AltAlleleNode::parse },
+    { std::string("gc"), GcNode::parse },
     { std::string("header"), HeaderRegExNode::parse },
+    { std::string("homopolymer"), HomopolymerNode::parse },
+    { std::string("mapping_quality"), MappingQualityNode::parse },
+    { std::string("motif"), MotifNode::parse<false> },
+    { std::string("motif_either"), MotifNode::parse<true> },
+    { std::string("n_count"), NCountNode::parse },
+    { std::string("name_in"), NameSetNode::parse },
+    { std::string("name_in_bam"), NameJoinNode::parse },
     { std::string("nt"), NucleotideNode<llvm::ConstantInt::getFalse>::parse },
+    { std::string("nt_any"), NucleotideSetNode::parse<false> },
     { std::string("nt_exact"),
       NucleotideNode<llvm::ConstantInt::getTrue>::parse },
-    { std::string("split_pair?"), SplitPairNode::parse },
-    { std::string("random"), RandomlyNode::parse }
+    { std::string("nt_exact_any"), NucleotideSetNode::parse<true> },
+    { std::string("random"), RandomlyNode::parse },
+    { std::string("split_pair?"), SplitPairNode::parse }
   };
 }
 }
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#include "bamql.hpp"
+
+/**
+ * Get a pointer, usable in the generated code, to a counter in this process.
+ */
+static llvm::Constant *counterPointer(uint64_t *counter) {
+  auto int64 = llvm::Type::getInt64Ty(llvm::getGlobalContext());
+  return llvm::ConstantExpr::getIntToPtr(
+      llvm::ConstantInt::get(int64, (uintptr_t)counter),
+      llvm::PointerType::get(int64, 0));
+}
+
+void bamql::Profile::record(GenerateState &state,
+                            AstNode *node,
+                            llvm::Value *result) {
+  auto &count = counts[node];
+  auto int64 = llvm::Type::getInt64Ty(llvm::getGlobalContext());
+  auto evaluated = counterPointer(&count.evaluated);
+  state->CreateStore(state->CreateAdd(state->CreateLoad(evaluated),
+                                      llvm::ConstantInt::get(int64, 1)),
+                     evaluated);
+  auto matched = counterPointer(&count.matched);
+  state->CreateStore(state->CreateAdd(state->CreateLoad(matched),
+                                      state->CreateZExt(result, int64)),
+                     matched);
+}
+
+double bamql::Profile::selectivity(AstNode *node) const {
+  auto it = counts.find(node);
+  if (it == counts.end() || it->second.evaluated == 0) {
+    return -1;
+  }
+  return (double)it->second.matched / it->second.evaluated;
+}
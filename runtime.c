@@ -14,6 +14,7 @@
  * credit be given to OICR scientists, as scientifically appropriate.
  */
 
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -21,13 +22,16 @@
 #include <string.h>
 #include <htslib/sam.h>
 #include <pcre.h>
+#include "runtime.h"
 
 /*
  * This file contains the “runtime” library for BAMQL.
  *
- * Every function here will be available in the generated code after calling
- * `define_module`.  This allows all these functions to be part of the output
- * binary, with static linkage.
+ * Every function here will be available in the generated code. This file is
+ * embedded in the library as bitcode and the functions a query uses are
+ * copied into the output binary by `linkRuntime`, with static linkage. It is
+ * also compiled natively for the interpreter, which calls the functions
+ * declared in runtime.h directly.
  *
  * This makes it trivial to root around in HTSlib's structures without having
  * to define them in LLVM.
@@ -36,16 +40,28 @@
  * bool. It is also important that they have no state and no side-effects.
  */
 
-bool bamql_re_match(const char *pattern, const char *input, size_t input_length)
+bool bamql_re_match(const char *pattern, const char *literal,
+		    size_t literal_length, const char *input,
+		    size_t input_length)
 {
+	/*
+	 * If the expression requires a literal string, look for it first. This
+	 * is much cheaper than running the expression and will reject most
+	 * input for selective expressions.
+	 */
+	if (literal_length > 0
+	    && memmem(input, input_length, literal, literal_length) == NULL) {
+		return false;
+	}
 	return pcre_exec((const pcre *)pattern, NULL, input, input_length, 0, 0,
 			 NULL, 0) >= 0;
 }
 
-bool header_regex(const char *pattern, bam1_t *read)
+bool header_regex(const char *pattern, const char *literal,
+		  size_t literal_length, bam1_t *read)
 {
-	return bamql_re_match(pattern, bam_get_qname(read),
-			      read->core.l_qname - 1);
+	return bamql_re_match(pattern, literal, literal_length,
+			      bam_get_qname(read), read->core.l_qname - 1);
 }
 
 bool globish_match(const char *pattern, const char *input)
@@ -104,6 +120,11 @@ bool check_flag(bam1_t *read, uint16_t flag)
 	return (flag & read->core.flag) == flag;
 }
 
+bool check_flag_mask(bam1_t *read, uint16_t mask, uint16_t value)
+{
+	return (read->core.flag & mask) == value;
+}
+
 bool check_chromosome_id(uint32_t chr_id, bam_hdr_t *header,
 			 const char *pattern)
 {
@@ -119,6 +140,19 @@ bool check_chromosome_id(uint32_t chr_id, bam_hdr_t *header,
 	return globish_match(pattern, real_name);
 }
 
+/*
+ * Find the entry for a read in a table with an entry for each target in the
+ * header, followed by one for reads with no target.
+ */
+uint64_t bamql_chain_dispatch(const uint64_t *table, bam_hdr_t *header,
+			      bam1_t *read)
+{
+	if (read->core.tid < 0 || read->core.tid >= header->n_targets) {
+		return table[header->n_targets];
+	}
+	return table[read->core.tid];
+}
+
 bool check_chromosome(bam1_t *read, bam_hdr_t *header, const char *pattern,
 		      bool mate)
 {
@@ -146,49 +180,325 @@ uint32_t compute_mapped_end(bam1_t *read)
 	}
 }
 
-bool check_nt(bam1_t *read, int32_t position, unsigned char nt, bool exact)
+#define BAMQL_KNOWN_MAPPED_END 1
+
+static uint32_t context_mapped_end(struct bamql_read_context *context,
+				   bam1_t *read)
+{
+	if (!(context->known & BAMQL_KNOWN_MAPPED_END)) {
+		context->mapped_end = compute_mapped_end(read);
+		context->known |= BAMQL_KNOWN_MAPPED_END;
+	}
+	return context->mapped_end;
+}
+
+/*
+ * Count the G or C bases and the N bases in 16 packed bases. Each base is a
+ * nibble with one bit per possible nucleotide, so a base is G or C if exactly
+ * one of the middle bits is set and neither of the outer ones is, and it is N
+ * if all four are set.
+ */
+static void count_composition(uint64_t word, uint32_t *gc, uint32_t *n)
+{
+	const uint64_t low = 0x1111111111111111ULL;
+	uint64_t b0 = word & low;
+	uint64_t b1 = (word >> 1) & low;
+	uint64_t b2 = (word >> 2) & low;
+	uint64_t b3 = (word >> 3) & low;
+
+	*gc += __builtin_popcountll((b1 ^ b2) & ~(b0 | b3));
+	*n += __builtin_popcountll(b0 & b1 & b2 & b3);
+}
+
+static void compute_composition(bam1_t *read, uint32_t *gc, uint32_t *n)
+{
+	const uint8_t *seq = bam_get_seq(read);
+	size_t full = read->core.l_qseq / 2;
+	uint8_t tail[8] = { 0 };
+	uint64_t word;
+	size_t it;
+
+	*gc = 0;
+	*n = 0;
+	for (it = 0; it + 8 <= full; it += 8) {
+		memcpy(&word, seq + it, 8);
+		count_composition(word, gc, n);
+	}
+	memcpy(tail, seq + it, full - it);
+	/* The unused half of the last byte is not always zero. */
+	if (read->core.l_qseq % 2 == 1) {
+		tail[full - it] = seq[full] & 0xF0;
+	}
+	memcpy(&word, tail, 8);
+	count_composition(word, gc, n);
+}
+
+/*
+ * Find the longest run of the same base, not counting N.
+ */
+static uint32_t compute_longest_run(bam1_t *read)
+{
+	const uint8_t *seq = bam_get_seq(read);
+	uint32_t longest = 0;
+	uint32_t run = 0;
+	int previous = -1;
+	int32_t it;
+
+	for (it = 0; it < read->core.l_qseq; it++) {
+		int nt = bam_seqi(seq, it);
+		if (nt == 15) {
+			run = 0;
+		} else if (nt == previous) {
+			run++;
+		} else {
+			run = 1;
+		}
+		previous = nt;
+		if (run > longest) {
+			longest = run;
+		}
+	}
+	return longest;
+}
+
+#define BAMQL_KNOWN_COMPOSITION 2
+#define BAMQL_KNOWN_LONGEST_RUN 4
+
+static void context_composition(struct bamql_read_context *context,
+				bam1_t *read)
+{
+	if (!(context->known & BAMQL_KNOWN_COMPOSITION)) {
+		compute_composition(read, &context->gc_count,
+				    &context->n_count);
+		context->known |= BAMQL_KNOWN_COMPOSITION;
+	}
+}
+
+/*
+ * Check a list of sites, sorted by position, against a read in a single pass
+ * over the CIGAR string. Positions are 1-based, relative to the chromosome,
+ * like those of `check_position`. The read's sequence is stored in reference
+ * orientation, so the strand does not matter. Sites in deletions or skipped
+ * regions never match.
+ */
+static bool match_nt_sites(bam1_t *read, struct bamql_read_context *context,
+			   const int32_t *positions, const unsigned char *nts,
+			   uint32_t count, bool exact)
 {
-	unsigned char read_nt;
-	int32_t mapped_position;
-	if (read->core.flag & BAM_FUNMAP) {
+	uint32_t *cigar = bam_get_cigar(read);
+	uint8_t *seq = bam_get_seq(read);
+	int32_t reference = read->core.pos + 1;
+	int32_t query = 0;
+	uint32_t site = 0;
+	uint32_t index;
+
+	if ((read->core.flag & BAM_FUNMAP) || count == 0) {
 		return false;
 	}
-	if (read->core.pos > position || compute_mapped_end(read) < position) {
+	if (positions[count - 1] < reference
+	    || (uint32_t) positions[0] > context_mapped_end(context, read)) {
 		return false;
 	}
-	if ((read->core.flag & BAM_FUNMAP) || read->core.n_cigar == 0) {
-		mapped_position =
-		    (read->core.flag & BAM_FREVERSE) ? (read->core.l_qseq -
-							position +
-							read->core.pos -
-							1) : (position -
-							      read->core.pos);
-	} else {
-		int32_t required_offset =
-		    (read->core.flag & BAM_FREVERSE) ? (read->core.l_qseq -
-							position +
-							read->core.pos -
-							1) : (position -
-							      read->core.pos);
-		mapped_position = 0;
-
-		for (int index = 0;
-		     index < read->core.n_cigar && required_offset > 0;
-		     index++) {
-			uint8_t consume =
-			    bam_cigar_type(bam_cigar_op
-					   (bam_get_cigar(read)[index]));
-			if (consume & 2)
-				required_offset--;
-			if (consume & 1)
-				mapped_position++;
+	if (read->core.n_cigar == 0) {
+		for (; site < count; site++) {
+			int32_t offset = positions[site] - reference;
+			unsigned char read_nt;
+			if (offset < 0 || offset >= read->core.l_qseq)
+				continue;
+			read_nt = bam_seqi(seq, offset);
+			if (exact ? (read_nt == nts[site]) : (read_nt & nts[site]))
+				return true;
+		}
+		return false;
+	}
+	for (index = 0; index < read->core.n_cigar && site < count; index++) {
+		int32_t length = bam_cigar_oplen(cigar[index]);
+		int type = bam_cigar_type(bam_cigar_op(cigar[index]));
+		/* Sites before this operation fell in a gap. */
+		while (site < count && positions[site] < reference)
+			site++;
+		if (type == 3) {
+			for (; site < count
+			     && positions[site] < reference + length; site++) {
+				unsigned char read_nt =
+				    bam_seqi(seq,
+					     query + positions[site] -
+					     reference);
+				if (exact ? (read_nt == nts[site])
+				    : (read_nt & nts[site]))
+					return true;
+			}
 		}
+		if (type & 1)
+			query += length;
+		if (type & 2)
+			reference += length;
 	}
-	read_nt = bam_seqi(bam_get_seq(read), mapped_position);
-	return exact ? (read_nt == nt) : (read_nt != 0);
+	return false;
 }
 
-bool check_position(bam_hdr_t *header, bam1_t *read, uint32_t start,
+bool check_nt(bam1_t *read, struct bamql_read_context *context,
+	      int32_t position, unsigned char nt, bool exact)
+{
+	return match_nt_sites(read, context, &position, &nt, 1, exact);
+}
+
+bool check_nt_any(bam1_t *read, struct bamql_read_context *context,
+		  const int32_t *positions, const unsigned char *nts,
+		  uint32_t count, bool exact)
+{
+	return match_nt_sites(read, context, positions, nts, count, exact);
+}
+
+/*
+ * Check if the read's sequence contains a motif, using the bit-parallel
+ * shift-and algorithm directly on the packed sequence. Bit j of a state is
+ * set if the last j + 1 bases match the first j + 1 bases of the motif. The
+ * mask for a base has bit j set if that base is allowed at position j of the
+ * motif; the masks for the motif are followed by those for its reverse
+ * complement, which are all zero if only the forward motif is wanted.
+ */
+bool check_motif(bam1_t *read, const uint64_t *masks, uint32_t length)
+{
+	const uint8_t *seq = bam_get_seq(read);
+	uint64_t done = 1ULL << (length - 1);
+	uint64_t forward = 0;
+	uint64_t reverse = 0;
+	int32_t it;
+
+	for (it = 0; it < read->core.l_qseq; it++) {
+		int nt = bam_seqi(seq, it);
+		forward = ((forward << 1) | 1) & masks[nt];
+		reverse = ((reverse << 1) | 1) & masks[16 + nt];
+		if (((forward | reverse) & done) != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Find a chromosome in a table of per-chromosome data. The names are sorted
+ * and packed one after another, each NUL-terminated, starting at the given
+ * offsets. As for `check_chromosome_id`, any `chr` prefix is ignored and case
+ * does not matter; the table's names have already been stripped and
+ * lowered.
+ */
+static int32_t find_table_chromosome(const char *names,
+				     const uint32_t *offsets, uint32_t count,
+				     const char *name)
+{
+	uint32_t low = 0;
+	uint32_t high = count;
+	if (strncasecmp("chr", name, 3) == 0) {
+		name += 3;
+	}
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+		int comparison = strcasecmp(names + offsets[middle], name);
+		if (comparison == 0)
+			return middle;
+		if (comparison < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return -1;
+}
+
+bool check_table_chromosome(uint32_t chr_id, bam_hdr_t *header,
+			    const char *names, const uint32_t *offsets,
+			    uint32_t count)
+{
+	return chr_id < header->n_targets
+	    && find_table_chromosome(names, offsets, count,
+				     header->target_name[chr_id]) >= 0;
+}
+
+/*
+ * Check a read against a table of sites. The sites of chromosome `i` are at
+ * indices `starts[i]` up to `starts[i + 1]`, sorted by position. Rather than
+ * sweeping through the table, which would need state, the first site the read
+ * covers is found by bisection; only the sites under the read are examined.
+ */
+bool check_alt_allele(bam_hdr_t *header, bam1_t *read,
+		      struct bamql_read_context *context, const char *names,
+		      const uint32_t *offsets, uint32_t count,
+		      const uint32_t *starts, const int32_t *positions,
+		      const unsigned char *nts)
+{
+	int32_t chromosome;
+	int32_t start = read->core.pos + 1;
+	uint32_t end;
+	uint32_t low;
+	uint32_t high;
+	uint32_t last;
+	if (read->core.tid < 0 || read->core.tid >= header->n_targets
+	    || (read->core.flag & BAM_FUNMAP)) {
+		return false;
+	}
+	chromosome = find_table_chromosome(names, offsets, count,
+					   header->target_name[read->core.tid]);
+	if (chromosome < 0) {
+		return false;
+	}
+	low = starts[chromosome];
+	high = starts[chromosome + 1];
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+		if (positions[middle] < start)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	end = context_mapped_end(context, read);
+	for (last = low;
+	     last < starts[chromosome + 1] && (uint32_t) positions[last] <= end;
+	     last++) ;
+	return match_nt_sites(read, context, positions + low, nts + low,
+			      last - low, true);
+}
+
+/*
+ * Check if a read overlaps any of a table of regions, using the same test as
+ * `check_position`. The regions of chromosome `i` are at indices `starts[i]`
+ * up to `starts[i + 1]`; they are sorted and do not overlap, so the ends are
+ * sorted too and only the first region ending after the read starts needs to
+ * be checked.
+ */
+bool check_region(bam_hdr_t *header, bam1_t *read,
+		  struct bamql_read_context *context, const char *names,
+		  const uint32_t *offsets, uint32_t count,
+		  const uint32_t *starts, const uint32_t *region_starts,
+		  const uint32_t *region_ends)
+{
+	int32_t chromosome;
+	uint32_t mapped_start = read->core.pos + 1;
+	uint32_t low;
+	uint32_t high;
+	if (read->core.tid < 0 || read->core.tid >= header->n_targets) {
+		return false;
+	}
+	chromosome = find_table_chromosome(names, offsets, count,
+					   header->target_name[read->core.tid]);
+	if (chromosome < 0) {
+		return false;
+	}
+	low = starts[chromosome];
+	high = starts[chromosome + 1];
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+		if (region_ends[middle] < mapped_start)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low < starts[chromosome + 1]
+	    && region_starts[low] <= context_mapped_end(context, read);
+}
+
+bool check_position(bam_hdr_t *header, bam1_t *read,
+		    struct bamql_read_context *context, uint32_t start,
 		    uint32_t end)
 {
 	uint32_t mapped_start = read->core.pos + 1;
@@ -196,16 +506,129 @@ bool check_position(bam_hdr_t *header, bam1_t *read, uint32_t start,
 	if (read->core.tid >= header->n_targets) {
 		return false;
 	}
-	mapped_end = compute_mapped_end(read);
+	mapped_end = context_mapped_end(context, read);
 	return (mapped_start <= start && mapped_end >= start)
 	    || (mapped_start <= end && mapped_end >= end)
 	    || (mapped_start >= start && mapped_end <= end);
 }
 
-bool check_aux_str(bam1_t *read, const char *pattern, char group1, char group2)
+/*
+ * Find the size of a value in the auxiliary data from its type code. Strings
+ * and arrays return their type code.
+ */
+static int aux_type_size(uint8_t type)
+{
+	switch (type) {
+	case 'A':
+	case 'c':
+	case 'C':
+		return 1;
+	case 's':
+	case 'S':
+		return 2;
+	case 'i':
+	case 'I':
+	case 'f':
+		return 4;
+	case 'd':
+		return 8;
+	case 'Z':
+	case 'H':
+	case 'B':
+		return type;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Find the start of the next field in the auxiliary data, given a pointer to
+ * the type code of a field, or NULL if the data is malformed.
+ */
+static uint8_t *skip_aux(uint8_t *s, uint8_t *end)
+{
+	int size = aux_type_size(*s);
+	uint32_t count;
+	s++;
+	switch (size) {
+	case 'Z':
+	case 'H':
+		while (s < end && *s != '\0') {
+			s++;
+		}
+		return s < end ? s + 1 : NULL;
+	case 'B':
+		if (end - s < 5) {
+			return NULL;
+		}
+		size = aux_type_size(*s);
+		memcpy(&count, s + 1, 4);
+		s += 5;
+		if (size == 0 || size > 8 || (uint64_t) size * count > end - s) {
+			return NULL;
+		}
+		return s + size * count;
+	case 0:
+		return NULL;
+	default:
+		return end - s < size ? NULL : s + size;
+	}
+}
+
+/*
+ * Find several fields in the auxiliary data in one pass. The tags are given
+ * as pairs of characters; for each one, the output is set to the same pointer
+ * `bam_aux_get` would return for the first field with that tag, or NULL.
+ */
+static void aux_scan(bam1_t *read, const char *tags, uint32_t count,
+		     const uint8_t **out)
+{
+	uint8_t *s = bam_get_aux(read);
+	uint8_t *end = read->data + read->l_data;
+	uint32_t it;
+	uint32_t missing = count;
+	for (it = 0; it < count; it++) {
+		out[it] = NULL;
+	}
+	while (s != NULL && missing > 0 && end - s >= 3) {
+		for (it = 0; it < count; it++) {
+			if (out[it] == NULL && s[0] == tags[2 * it]
+			    && s[1] == tags[2 * it + 1]) {
+				out[it] = s + 2;
+				missing--;
+			}
+		}
+		s = skip_aux(s + 2, end);
+	}
+}
+
+#define BAMQL_KNOWN_AUX 8
+
+/*
+ * Get one of the fields the query uses from the auxiliary data. The first
+ * time any of them is needed for a read, all of them are found in one scan,
+ * so reads rejected before any auxiliary data is checked are never scanned.
+ */
+const uint8_t *bamql_aux_lookup(bam1_t *read,
+				struct bamql_read_context *context,
+				const char *tags, uint32_t count,
+				const uint8_t **values, uint32_t index)
+{
+	if (!(context->known & BAMQL_KNOWN_AUX)) {
+		aux_scan(read, tags, count, values);
+		context->known |= BAMQL_KNOWN_AUX;
+	}
+	return values[index];
+}
+
+const uint8_t *bamql_aux_get(bam1_t *read, char group1, char group2)
 {
 	char const id[] = { group1, group2 };
-	uint8_t const *value = bam_aux_get(read, id);
+	return bam_aux_get(read, id);
+}
+
+bool check_aux_str(const uint8_t *value, const char *pattern)
+{
 	const char *str;
 
 	if (value == NULL || (str = bam_aux2Z(value)) == NULL) {
@@ -214,27 +637,157 @@ bool check_aux_str(bam1_t *read, const char *pattern, char group1, char group2)
 	return globish_match(pattern, str);
 }
 
-bool check_aux_char(bam1_t *read, char pattern, char group1, char group2)
+bool check_aux_char(const uint8_t *value, char pattern)
 {
-	char const id[] = { group1, group2 };
-	uint8_t const *value = bam_aux_get(read, id);
 	return value != NULL && bam_aux2A(value) == pattern;
 }
 
-bool check_aux_int(bam1_t *read, int32_t pattern, char group1, char group2)
+bool check_aux_int(const uint8_t *value, int32_t pattern)
 {
-	char const id[] = { group1, group2 };
-	uint8_t const *value = bam_aux_get(read, id);
 	return value != NULL && bam_aux2i(value) == pattern;
 }
 
-bool check_aux_double(bam1_t *read, double pattern, char group1, char group2)
+bool check_aux_double(const uint8_t *value, double pattern)
 {
-	char const id[] = { group1, group2 };
-	uint8_t const *value = bam_aux_get(read, id);
 	return value != NULL && bam_aux2f(value) == (float)pattern;
 }
 
+/*
+ * Hash a string for a string set. The compiler builds the sets using this
+ * same function.
+ */
+uint32_t bamql_string_hash(const char *str)
+{
+	uint32_t hash = 2166136261U;
+
+	for (; *str != '\0'; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 16777619U;
+	}
+	/* The sets use the low bits, so mix in the high ones. */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+/*
+ * Check if a string is in a set. The set is an open addressing hash table
+ * of (hash, offset) pairs, where the offset is into a block of
+ * NUL-terminated strings and UINT32_MAX marks an empty slot. Only strings
+ * with the same full hash are compared.
+ */
+bool check_string_set(const char *value, const char *strings,
+		      const uint32_t *table, uint32_t mask)
+{
+	uint32_t hash;
+	uint32_t index;
+
+	if (value == NULL) {
+		return false;
+	}
+	hash = bamql_string_hash(value);
+	for (index = hash & mask; table[2 * index + 1] != UINT32_MAX;
+	     index = (index + 1) & mask) {
+		if (table[2 * index] == hash
+		    && strcmp(strings + table[2 * index + 1], value) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool check_name_in(bam1_t *read, const char *strings, const uint32_t *table,
+		   uint32_t mask)
+{
+	return check_string_set(bam_get_qname(read), strings, table, mask);
+}
+
+bool check_aux_in(const uint8_t *value, const char *strings,
+		  const uint32_t *table, uint32_t mask)
+{
+	return value != NULL
+	    && check_string_set(bam_aux2Z(value), strings, table, mask);
+}
+
+/*
+ * Compute a 64-bit fingerprint of a string. Zero is never returned, so it can
+ * mark an empty slot in a set of fingerprints.
+ */
+uint64_t bamql_fingerprint(const char *str)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (; *str != '\0'; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 1099511628211ULL;
+	}
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	return hash == 0 ? 1 : hash;
+}
+
+/*
+ * Check if a string's fingerprint is in an open addressing hash table of
+ * fingerprints.
+ */
+bool check_fingerprint_set(const char *value, const uint64_t *table,
+			   uint32_t mask)
+{
+	uint64_t fingerprint;
+	uint32_t index;
+
+	if (value == NULL) {
+		return false;
+	}
+	fingerprint = bamql_fingerprint(value);
+	for (index = fingerprint & mask; table[index] != 0;
+	     index = (index + 1) & mask) {
+		if (table[index] == fingerprint) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool check_name_fingerprint(bam1_t *read, const uint64_t *table, uint32_t mask)
+{
+	return check_fingerprint_set(bam_get_qname(read), table, mask);
+}
+
+bool check_gc(bam1_t *read, struct bamql_read_context *context, double min,
+	      double max)
+{
+	uint32_t bases;
+
+	context_composition(context, read);
+	bases = read->core.l_qseq - context->n_count;
+	return bases > 0 && context->gc_count >= min * bases
+	    && context->gc_count <= max * bases;
+}
+
+bool check_n_count(bam1_t *read, struct bamql_read_context *context,
+		   uint32_t max)
+{
+	context_composition(context, read);
+	return context->n_count <= max;
+}
+
+bool check_homopolymer(bam1_t *read, struct bamql_read_context *context,
+		       uint32_t length)
+{
+	if (!(context->known & BAMQL_KNOWN_LONGEST_RUN)) {
+		context->longest_run = compute_longest_run(read);
+		context->known |= BAMQL_KNOWN_LONGEST_RUN;
+	}
+	return context->longest_run >= length;
+}
+
 bool check_split_pair(bam_hdr_t *header, bam1_t *read)
 {
 	if (read->core.tid < header->n_targets
@@ -244,7 +797,102 @@ bool check_split_pair(bam_hdr_t *header, bam1_t *read)
 	return false;
 }
 
-bool randomly(double probability)
+/*
+ * Choose reads by a hash of the name, so that the choice does not depend on
+ * the order or number of threads or processes reading the file, and mates are
+ * chosen together. A trailing /1 or /2 is not part of the template name.
+ */
+bool randomly(bam1_t *read, double probability, uint32_t seed)
 {
-	return probability < drand48();
+	const char *name = bam_get_qname(read);
+	size_t length = strlen(name);
+	uint64_t hash = 14695981039346656037ULL;
+	size_t it;
+	if (length >= 2 && name[length - 2] == '/'
+	    && (name[length - 1] == '1' || name[length - 1] == '2')) {
+		length -= 2;
+	}
+	/* FNV-1a, then the SplitMix64 finaliser to spread the seed. */
+	for (it = 0; it < length; it++) {
+		hash ^= (unsigned char)name[it];
+		hash *= 1099511628211ULL;
+	}
+	hash ^= seed;
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	return (hash >> 11) * (1.0 / 9007199254740992.0) < probability;
+}
+
+/*
+ * The following functions copy a field out of every read in a batch so that
+ * the generated code can examine the field for many reads at once.
+ */
+int32_t bamql_header_targets(bam_hdr_t *header)
+{
+	return header->n_targets;
+}
+
+void bamql_gather_flag(bam1_t **reads, size_t count, uint16_t *out)
+{
+	size_t it;
+	for (it = 0; it < count; it++) {
+		out[it] = reads[it]->core.flag;
+	}
+}
+
+void bamql_gather_tid(bam1_t **reads, size_t count, int32_t *out)
+{
+	size_t it;
+	for (it = 0; it < count; it++) {
+		out[it] = reads[it]->core.tid;
+	}
+}
+
+void bamql_gather_start(bam1_t **reads, size_t count, uint32_t *out)
+{
+	size_t it;
+	for (it = 0; it < count; it++) {
+		out[it] = reads[it]->core.pos + 1;
+	}
+}
+
+void bamql_gather_end(bam1_t **reads, size_t count, uint32_t *out)
+{
+	size_t it;
+	for (it = 0; it < count; it++) {
+		out[it] = compute_mapped_end(reads[it]);
+	}
+}
+
+void bamql_gather_quality(bam1_t **reads, size_t count, uint8_t *out)
+{
+	size_t it;
+	for (it = 0; it < count; it++) {
+		out[it] = reads[it]->core.qual;
+	}
+}
+
+/*
+ * Reads are usually sorted, so the chromosome name only needs to be matched
+ * when it changes.
+ */
+void bamql_gather_chromosome(bam1_t **reads, size_t count, uint8_t *out,
+			     bam_hdr_t *header, const char *pattern, bool mate)
+{
+	size_t it;
+	int32_t last_tid = -1;
+	bool last_match = false;
+	for (it = 0; it < count; it++) {
+		int32_t tid =
+		    mate ? reads[it]->core.mtid : reads[it]->core.tid;
+		if (it == 0 || tid != last_tid) {
+			last_tid = tid;
+			last_match =
+			    check_chromosome_id(tid, header, pattern);
+		}
+		out[it] = last_match;
+	}
 }
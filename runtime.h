@@ -0,0 +1,105 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <htslib/sam.h>
+
+/*
+ * The functions of the runtime library that are called directly, rather than
+ * from generated code, by the interpreter. See runtime.c.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Values derived from a read that more than one predicate may need. The
+ * generated code keeps one for the read being examined and clears `known`
+ * before each read; each value is computed the first time it is used.
+ */
+struct bamql_read_context {
+	uint32_t known;
+	uint32_t mapped_end;
+	uint32_t gc_count;
+	uint32_t n_count;
+	uint32_t longest_run;
+};
+
+bool bamql_re_match(const char *pattern, const char *literal,
+		    size_t literal_length, const char *input,
+		    size_t input_length);
+bool check_flag(bam1_t *read, uint16_t flag);
+bool check_flag_mask(bam1_t *read, uint16_t mask, uint16_t value);
+bool check_chromosome_id(uint32_t chr_id, bam_hdr_t *header,
+			 const char *pattern);
+bool check_chromosome(bam1_t *read, bam_hdr_t *header, const char *pattern,
+		      bool mate);
+bool check_mapping_quality(bam1_t *read, uint8_t quality);
+bool check_nt(bam1_t *read, struct bamql_read_context *context,
+	      int32_t position, unsigned char nt, bool exact);
+bool check_nt_any(bam1_t *read, struct bamql_read_context *context,
+		  const int32_t *positions, const unsigned char *nts,
+		  uint32_t count, bool exact);
+bool check_motif(bam1_t *read, const uint64_t *masks, uint32_t length);
+bool check_gc(bam1_t *read, struct bamql_read_context *context, double min,
+	      double max);
+bool check_n_count(bam1_t *read, struct bamql_read_context *context,
+		   uint32_t max);
+bool check_homopolymer(bam1_t *read, struct bamql_read_context *context,
+		       uint32_t length);
+bool check_table_chromosome(uint32_t chr_id, bam_hdr_t *header,
+			    const char *names, const uint32_t *offsets,
+			    uint32_t count);
+bool check_alt_allele(bam_hdr_t *header, bam1_t *read,
+		      struct bamql_read_context *context, const char *names,
+		      const uint32_t *offsets, uint32_t count,
+		      const uint32_t *starts, const int32_t *positions,
+		      const unsigned char *nts);
+bool check_region(bam_hdr_t *header, bam1_t *read,
+		  struct bamql_read_context *context, const char *names,
+		  const uint32_t *offsets, uint32_t count,
+		  const uint32_t *starts, const uint32_t *region_starts,
+		  const uint32_t *region_ends);
+bool check_position(bam_hdr_t *header, bam1_t *read,
+		    struct bamql_read_context *context, uint32_t start,
+		    uint32_t end);
+const uint8_t *bamql_aux_get(bam1_t *read, char group1, char group2);
+bool check_aux_str(const uint8_t *value, const char *pattern);
+bool check_aux_char(const uint8_t *value, char pattern);
+bool check_aux_int(const uint8_t *value, int32_t pattern);
+bool check_aux_double(const uint8_t *value, double pattern);
+uint32_t bamql_string_hash(const char *str);
+bool check_string_set(const char *value, const char *strings,
+		      const uint32_t *table, uint32_t mask);
+bool check_name_in(bam1_t *read, const char *strings, const uint32_t *table,
+		   uint32_t mask);
+bool check_aux_in(const uint8_t *value, const char *strings,
+		  const uint32_t *table, uint32_t mask);
+uint64_t bamql_fingerprint(const char *str);
+bool check_fingerprint_set(const char *value, const uint64_t *table,
+			   uint32_t mask);
+bool check_name_fingerprint(bam1_t *read, const uint64_t *table,
+			    uint32_t mask);
+bool check_split_pair(bam_hdr_t *header, bam1_t *read);
+bool randomly(bam1_t *read, double probability, uint32_t seed);
+
+#ifdef __cplusplus
+}
+#endif
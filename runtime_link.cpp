@@ -0,0 +1,251 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#include <set>
+#include <vector>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+#include "bamql.hpp"
+
+namespace bamql {
+/*
+ * The bitcode for runtime.c, generated by the build.
+ */
+extern const unsigned char runtime_bitcode[];
+extern const size_t runtime_bitcode_size;
+
+/**
+ * Load the runtime library from the embedded bitcode. Only the declarations
+ * are read; the body of a function is read the first time it is linked into
+ * a query.
+ */
+llvm::Module *getRuntimeModule() {
+  static llvm::Module *runtime = nullptr;
+  if (runtime != nullptr) {
+    return runtime;
+  }
+  llvm::StringRef data((const char *)runtime_bitcode, runtime_bitcode_size);
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 4
+  std::string error;
+  runtime = llvm::getLazyBitcodeModule(
+      llvm::MemoryBuffer::getMemBuffer(data, "runtime", false),
+      llvm::getGlobalContext(),
+      &error);
+  if (runtime == nullptr) {
+    llvm::report_fatal_error("Cannot load BAMQL runtime: " + error);
+  }
+#else
+  auto result = llvm::getLazyBitcodeModule(
+      llvm::MemoryBuffer::getMemBuffer(data, "runtime", false),
+      llvm::getGlobalContext());
+  if (!result) {
+    llvm::report_fatal_error("Cannot load BAMQL runtime: " +
+                             result.getError().message());
+  }
+  runtime = result.get();
+#endif
+  return runtime;
+}
+
+/**
+ * Determine if a runtime function has a body, whether or not it has been read.
+ */
+static bool hasBody(llvm::Function *function) {
+  return !function->isDeclaration() || function->isMaterializable();
+}
+
+/**
+ * Declare every function in the runtime library in a module, so that the
+ * generated code can call them.
+ */
+void declareRuntime(llvm::Module *module) {
+  auto runtime = getRuntimeModule();
+  for (auto it = runtime->begin(); it != runtime->end(); it++) {
+    if (!hasBody(&*it) || it->hasLocalLinkage() ||
+        module->getFunction(it->getName()) != nullptr) {
+      continue;
+    }
+    auto function = llvm::Function::Create(it->getFunctionType(),
+                                           llvm::GlobalValue::ExternalLinkage,
+                                           it->getName(),
+                                           module);
+    function->copyAttributesFrom(&*it);
+  }
+}
+
+/**
+ * Find all the global variables and functions used by a value.
+ */
+static void findGlobals(llvm::Value *value,
+                        std::vector<llvm::GlobalValue *> &globals,
+                        std::set<llvm::Value *> &seen) {
+  if (!seen.insert(value).second) {
+    return;
+  }
+  if (auto global = llvm::dyn_cast<llvm::GlobalValue>(value)) {
+    globals.push_back(global);
+  } else if (auto constant = llvm::dyn_cast<llvm::Constant>(value)) {
+    for (unsigned int it = 0; it < constant->getNumOperands(); it++) {
+      findGlobals(constant->getOperand(it), globals, seen);
+    }
+  }
+}
+
+/**
+ * Find or create the equivalent of a runtime global in a module. Any runtime
+ * functions that need to be copied are added to the pending list.
+ */
+static llvm::Value *mapGlobal(llvm::Module *module,
+                              llvm::GlobalValue *global,
+                              llvm::ValueToValueMapTy &map,
+                              std::vector<llvm::Function *> &pending) {
+  auto found = map.find(global);
+  if (found != map.end()) {
+    return found->second;
+  }
+  if (auto function = llvm::dyn_cast<llvm::Function>(global)) {
+    llvm::Function *target = function->hasLocalLinkage()
+                                 ? nullptr
+                                 : module->getFunction(function->getName());
+    if (target == nullptr) {
+      target = llvm::Function::Create(function->getFunctionType(),
+                                      llvm::GlobalValue::ExternalLinkage,
+                                      function->getName(),
+                                      module);
+      target->copyAttributesFrom(function);
+    }
+    map[function] = target;
+    if (hasBody(function) && target->isDeclaration()) {
+      pending.push_back(function);
+    }
+    return target;
+  }
+
+  auto variable = llvm::cast<llvm::GlobalVariable>(global);
+  llvm::GlobalVariable *target =
+      variable->hasLocalLinkage()
+          ? nullptr
+          : module->getGlobalVariable(variable->getName());
+  if (target == nullptr) {
+    target = new llvm::GlobalVariable(*module,
+                                      variable->getType()->getElementType(),
+                                      variable->isConstant(),
+                                      variable->getLinkage(),
+                                      nullptr,
+                                      variable->getName(),
+                                      nullptr,
+                                      variable->getThreadLocalMode(),
+                                      variable->getType()->getAddressSpace());
+    target->copyAttributesFrom(variable);
+    if (variable->hasInitializer() && !variable->hasLocalLinkage()) {
+      target->setLinkage(llvm::GlobalValue::InternalLinkage);
+    }
+  }
+  map[variable] = target;
+  if (variable->hasInitializer() && !target->hasInitializer()) {
+    std::vector<llvm::GlobalValue *> globals;
+    std::set<llvm::Value *> seen;
+    findGlobals(variable->getInitializer(), globals, seen);
+    for (auto it = globals.begin(); it != globals.end(); it++) {
+      mapGlobal(module, *it, map, pending);
+    }
+    target->setInitializer(
+        llvm::cast<llvm::Constant>(llvm::MapValue(variable->getInitializer(),
+                                                  map,
+                                                  llvm::RF_None)));
+  }
+  return target;
+}
+
+void linkRuntime(llvm::Module *module) {
+  auto runtime = getRuntimeModule();
+  llvm::ValueToValueMapTy map;
+  std::vector<llvm::Function *> pending;
+  std::vector<llvm::Function *> unused;
+
+  // Start with every runtime function the generated code calls.
+  for (auto it = module->begin(); it != module->end(); it++) {
+    if (!it->isDeclaration()) {
+      continue;
+    }
+    auto source = runtime->getFunction(it->getName());
+    if (source == nullptr || !hasBody(source) ||
+        source->getFunctionType() != it->getFunctionType()) {
+      continue;
+    }
+    if (it->use_empty()) {
+      unused.push_back(&*it);
+    } else {
+      map[source] = &*it;
+      pending.push_back(source);
+    }
+  }
+  for (auto it = unused.begin(); it != unused.end(); it++) {
+    (*it)->eraseFromParent();
+  }
+
+  // Copy the bodies of those functions, and anything they in turn use.
+  while (!pending.empty()) {
+    auto source = pending.back();
+    pending.pop_back();
+    auto target = llvm::cast<llvm::Function>(map[source]);
+    if (!target->isDeclaration()) {
+      continue;
+    }
+    if (source->isMaterializable()) {
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 4
+      std::string error;
+      if (source->Materialize(&error)) {
+        llvm::report_fatal_error("Cannot load BAMQL runtime: " + error);
+      }
+#else
+      auto error = source->materialize();
+      if (error) {
+        llvm::report_fatal_error("Cannot load BAMQL runtime: " +
+                                 error.message());
+      }
+#endif
+    }
+
+    auto target_arg = target->arg_begin();
+    for (auto arg = source->arg_begin(); arg != source->arg_end();
+         arg++, target_arg++) {
+      target_arg->setName(arg->getName());
+      map[&*arg] = &*target_arg;
+    }
+    std::vector<llvm::GlobalValue *> globals;
+    std::set<llvm::Value *> seen;
+    for (auto block = source->begin(); block != source->end(); block++) {
+      for (auto inst = block->begin(); inst != block->end(); inst++) {
+        for (unsigned int it = 0; it < inst->getNumOperands(); it++) {
+          findGlobals(inst->getOperand(it), globals, seen);
+        }
+      }
+    }
+    for (auto it = globals.begin(); it != globals.end(); it++) {
+      mapGlobal(module, *it, map, pending);
+    }
+
+    llvm::SmallVector<llvm::ReturnInst *, 8> returns;
+    llvm::CloneFunctionInto(target, source, map, true, returns);
+    target->setLinkage(llvm::GlobalValue::InternalLinkage);
+  }
+}
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2015 Paul Boutros. For details, see COPYING. Our lawyer cats sez:
+ *
+ * OICR makes no representations whatsoever as to the SOFTWARE contained
+ * herein.  It is experimental in nature and is provided WITHOUT WARRANTY OF
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE OR ANY OTHER WARRANTY,
+ * EXPRESS OR IMPLIED. OICR MAKES NO REPRESENTATION OR WARRANTY THAT THE USE OF
+ * THIS SOFTWARE WILL NOT INFRINGE ANY PATENT OR OTHER PROPRIETARY RIGHT.  By
+ * downloading this SOFTWARE, your Institution hereby indemnifies OICR against
+ * any loss, claim, damage or liability, of whatsoever kind or nature, which
+ * may arise from your Institution's respective use, handling or storage of the
+ * SOFTWARE. If publications result from research using this SOFTWARE, we ask
+ * that the Ontario Institute for Cancer Research be acknowledged and/or
+ * credit be given to OICR scientists, as scientifically appropriate.
+ */
+
+#include "bamql.hpp"
+
+namespace bamql {
+
+VectorColumns::VectorColumns(llvm::Value *header_,
+                             llvm::Value *reads_,
+                             llvm::Value *count_,
+                             llvm::Value *lane_,
+                             llvm::Instruction *gather_point)
+    : header_value(header_), reads(reads_), count(count_), lane(lane_),
+      gather(gather_point), targets(nullptr) {}
+
+llvm::Value *VectorColumns::load(GenerateState &state,
+                                 llvm::StringRef gather_fn,
+                                 const std::vector<llvm::Value *> &extra) {
+  auto function = state.module()->getFunction(gather_fn);
+  auto key = std::make_pair(function, extra);
+  auto it = columns.find(key);
+  llvm::Value *column;
+  if (it == columns.end()) {
+    // Allocate the column for the largest batch, including the padding at
+    // the end, and fill it before the vector loop starts. The padding lanes
+    // are never written back, so they can hold anything. The allocation has
+    // a fixed size and is in the entry block, so it is only made once.
+    auto type = llvm::cast<llvm::PointerType>(
+                    function->getFunctionType()->getParamType(2))
+                    ->getElementType();
+    auto &entry = gather.GetInsertBlock()->getParent()->getEntryBlock();
+    llvm::IRBuilder<> alloca_builder(&entry, entry.begin());
+    auto alloca = alloca_builder.CreateAlloca(
+        type,
+        llvm::ConstantInt::get(count->getType(), MAX_BATCH),
+        gather_fn + "_column");
+    alloca->setAlignment(16);
+    std::vector<llvm::Value *> args;
+    args.push_back(reads);
+    args.push_back(count);
+    args.push_back(alloca);
+    args.insert(args.end(), extra.begin(), extra.end());
+    gather.CreateCall(function, args);
+    column = alloca;
+    columns[key] = column;
+  } else {
+    column = it->second;
+  }
+  auto vector_type = llvm::VectorType::get(
+      llvm::cast<llvm::PointerType>(column->getType())->getElementType(),
+      WIDTH);
+  return state->CreateAlignedLoad(
+      state->CreateBitCast(state->CreateGEP(column, lane),
+                           llvm::PointerType::get(vector_type, 0)),
+      16);
+}
+
+llvm::Value *VectorColumns::header() const { return header_value; }
+
+llvm::Value *VectorColumns::targetCount(GenerateState &state) {
+  if (targets == nullptr) {
+    auto function = state.module()->getFunction("bamql_header_targets");
+    targets = gather.CreateVectorSplat(
+        WIDTH, gather.CreateCall(function, header_value));
+  }
+  return targets;
+}
+
+llvm::Constant *VectorColumns::splat(llvm::Constant *value) {
+  return llvm::ConstantVector::getSplat(WIDTH, value);
+}
+}